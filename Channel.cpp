@@ -0,0 +1,171 @@
+//Channel.cpp - applies simulated broadcast impairments to frames
+
+/*Copyright (c) 2020, Frank J. LoPinto
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.*/
+
+#include <math.h>
+#include <string.h>
+#include "Channel.h"
+
+const int npixels = width*height;
+
+Channel::Channel(const ChannelParms &Parms) {
+    parms = Parms;
+    state = parms.seed * 2654435761ULL + 1;
+    previous = new int[npixels];
+    havePrevious = false;
+    for(int i=0;i<3;i++) plane[i] = new float[npixels];
+    scratch = new float[npixels];
+
+    //Blur kernel out to three standard deviations
+    radius = parms.blur > 0 ? (int)ceil(3*parms.blur) : 0;
+    kernel = new float[2*radius + 1];
+    double sum = 0;
+    for(int i=-radius;i<=radius;i++) {
+        kernel[i+radius] = parms.blur > 0 ? exp(-0.5*i*i/(parms.blur*parms.blur)) : 1;
+        sum += kernel[i+radius];
+    }
+    for(int i=0;i<=2*radius;i++) kernel[i] /= sum;
+}
+
+Channel::~Channel() {
+    delete [] previous;
+    for(int i=0;i<3;i++) delete [] plane[i];
+    delete [] scratch;
+    delete [] kernel;
+}
+
+double Channel::uniform() {
+
+    //xorshift64*, returning a number in (0,1)
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return ((state * 2685821657736338717ULL) >> 11) * (1.0/9007199254740992.0) + 1e-300;
+}
+
+double Channel::gaussian() {
+    return sqrt(-2*log(uniform())) * cos(2*M_PI*uniform());   //Box-Muller
+}
+
+bool Channel::transmit(const int *in, int *out) {
+
+    //Decide about the frame before touching it, so that the random
+    //sequence doesn't depend on which impairments are turned on
+    bool dropped = uniform() < parms.dropRate;
+    bool mixed = havePrevious && uniform() < parms.interlace;
+    bool damaged = uniform() < parms.damageRate;
+    int top = (int)(uniform() * (height - parms.damageRows + 1));
+    int color[3];
+    for(int i=0;i<3;i++) color[i] = (int)(uniform() * 256);
+
+    for(int y=0;y<height;y++) {
+        const int *src = (mixed && (y & 1)) ? previous : in;
+        for(int x=0;x<width;x++) {
+            int z = y*width + x;
+            plane[0][z] = (src[z] >> 16) & 0xFF;
+            plane[1][z] = (src[z] >>  8) & 0xFF;
+            plane[2][z] = (src[z]      ) & 0xFF;
+        }
+    }
+    memcpy(previous, in, npixels*sizeof(int));
+    havePrevious = true;
+    if(dropped) return false;
+
+    if(damaged && parms.damageRows > 0) {
+        int bottom = top + parms.damageRows < height ? top + parms.damageRows : height;
+        for(int z=top*width;z<bottom*width;z++)
+            for(int i=0;i<3;i++) plane[i][z] = color[i];
+    }
+
+    if(parms.chroma420) subsampleChroma();
+    if(radius) for(int i=0;i<3;i++) blurPlane(plane[i]);
+
+    for(int z=0;z<npixels;z++) {
+        int pixel = 0xFF000000;
+        for(int i=0;i<3;i++) {
+            double v = plane[i][z] + parms.shift[i];
+            if(parms.noise > 0) v += parms.noise * gaussian();
+            int level = (int)(v + 0.5);
+            if(level < 0)   level = 0;
+            if(level > 255) level = 255;
+            pixel |= level << (8*(2-i));
+        }
+        out[z] = pixel;
+    }
+    return true;
+}
+
+void Channel::subsampleChroma() {
+
+    //BT.601 YCbCr.  Luma keeps full resolution, Cb and Cr are averaged
+    //over each 2x2 block of pixels.
+    for(int y=0;y<height;y+=2) {
+        for(int x=0;x<width;x+=2) {
+            int z[4] = {y*width + x, y*width + x+1, (y+1)*width + x, (y+1)*width + x+1};
+            float luma[4], cb = 0, cr = 0;
+            for(int k=0;k<4;k++) {
+                float r = plane[0][z[k]], g = plane[1][z[k]], b = plane[2][z[k]];
+                luma[k] = 0.299f*r + 0.587f*g + 0.114f*b;
+                cb += (b - luma[k]) * 0.564f;
+                cr += (r - luma[k]) * 0.713f;
+            }
+            cb /= 4;
+            cr /= 4;
+            for(int k=0;k<4;k++) {
+                plane[0][z[k]] = luma[k] + 1.403f*cr;
+                plane[1][z[k]] = luma[k] - 0.344f*cb - 0.714f*cr;
+                plane[2][z[k]] = luma[k] + 1.773f*cb;
+            }
+        }
+    }
+}
+
+void Channel::blurPlane(float *p) {
+
+    //Separable: blur the rows into scratch, then the columns back into p.
+    //Pixels beyond the edge repeat the edge.
+    for(int y=0;y<height;y++) {
+        for(int x=0;x<width;x++) {
+            float sum = 0;
+            for(int i=-radius;i<=radius;i++) {
+                int xx = x + i;
+                if(xx < 0) xx = 0;
+                if(xx >= width) xx = width - 1;
+                sum += kernel[i+radius] * p[y*width + xx];
+            }
+            scratch[y*width + x] = sum;
+        }
+    }
+    for(int y=0;y<height;y++) {
+        for(int x=0;x<width;x++) {
+            float sum = 0;
+            for(int i=-radius;i<=radius;i++) {
+                int yy = y + i;
+                if(yy < 0) yy = 0;
+                if(yy >= height) yy = height - 1;
+                sum += kernel[i+radius] * scratch[yy*width + x];
+            }
+            p[y*width + x] = sum;
+        }
+    }
+}
@@ -0,0 +1,59 @@
+//Channel.h - simulates the impairments of a broadcast video chain
+#ifndef CHANNEL_H
+#define CHANNEL_H
+#include "pxit-parms.h"
+
+/* A Channel takes a clean width x height frame of 0xAARRGGBB pixels and
+ * produces what a receiver might capture after the picture went through a
+ * broadcast chain.  The impairments are applied in the order they happen
+ * on the air:
+ *
+ *   interlace  the second field is taken from the previous frame, as when
+ *              the capture straddles a frame change
+ *   damage     a stripe of rows at a random height is painted over with a
+ *              flat color, as by a caption, logo or tape dropout
+ *   chroma     YCbCr 4:2:0, i.e. chroma averaged over 2x2 pixels
+ *   blur       Gaussian, as from scaling and analog filtering
+ *   shift      offsets added to red, green and blue
+ *   noise      Gaussian, independent for every pixel and channel
+ *   drop       the whole frame is lost
+ *
+ * The random sequence depends only on the seed, so runs are repeatable.
+ */
+struct ChannelParms {
+    bool     chroma420;         //subsample chroma
+    double   noise;             //standard deviation, in 8-bit levels
+    double   blur;              //standard deviation, in pixels
+    int      shift[3];          //added to red, green, blue
+    double   dropRate;          //probability that a frame is lost
+    double   interlace;         //probability of mixing fields of two frames
+    double   damageRate;        //probability that a stripe is painted over
+    int      damageRows;        //height of the stripe, in pixels
+    unsigned seed;
+};
+
+class Channel {
+public:
+    Channel(const ChannelParms &parms);
+    ~Channel();
+
+    //false if the frame was dropped, otherwise 'out' holds the received frame
+    bool transmit(const int *in, int *out);
+
+private:
+    ChannelParms       parms;
+    unsigned long long state;           //random number generator
+    int               *previous;        //last frame sent, for interlace
+    bool               havePrevious;
+    float             *plane[3];        //red, green, blue
+    float             *scratch;
+    float             *kernel;
+    int                radius;
+
+    double uniform();
+    double gaussian();
+    void   subsampleChroma();
+    void   blurPlane(float *p);
+};
+
+#endif // CHANNEL_H
@@ -26,6 +26,96 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE*/
 #include <stdio.h>
 #include <string.h>
 #include "checksum.h"
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+//Tags added to the check bytes of each kind of packet.  Any value other
+//than zero would do; these spell "PXIT".
+const unsigned char CheckSum::tags[tagIntegrity][4] = {
+	{0x00, 0x00, 0x00, 0x00},	//tagNone
+	{0x50, 0x58, 0x49, 0x54},	//tagExtended
+};
+const unsigned int CheckSum::crcDeltaTag = 0x444C5441;	//"DLTA"
+
+//Table for computing CRC32C a byte at a time, built when the program
+//starts, and whether the CPU can do it in hardware instead.
+static struct CrcTable {
+	unsigned int entry[256];
+	bool         hardware;
+
+	CrcTable() {
+		for(unsigned int i=0; i<256; i++) {
+			unsigned int crc = i;
+			for(int k=0; k<8; k++)
+				crc = (crc >> 1) ^ (crc & 1 ? 0x82F63B78 : 0);
+			entry[i] = crc;
+		}
+		hardware = false;
+#if defined(__x86_64__)
+		__builtin_cpu_init();
+		hardware = __builtin_cpu_supports("sse4.2");
+#endif
+	}
+} crcTable;
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static unsigned int crc32cHardware(const unsigned char *buf, int len, unsigned int crc) {
+	unsigned long long crc64 = crc;
+	for(; len >= 8; len -= 8, buf += 8) {
+		unsigned long long word;
+		memcpy(&word, buf, 8);
+		crc64 = _mm_crc32_u64(crc64, word);
+	}
+	crc = (unsigned int)crc64;
+	for(; len > 0; len--) crc = _mm_crc32_u8(crc, *buf++);
+	return crc;
+}
+#endif
+
+unsigned int CheckSum::crc32c(const unsigned char *buf, int len) {
+	unsigned int crc = 0xFFFFFFFF;
+#if defined(__x86_64__)
+	if(crcTable.hardware) return ~crc32cHardware(buf, len, crc);
+#endif
+	for(int i=0; i<len; i++)
+		crc = (crc >> 8) ^ crcTable.entry[(crc ^ buf[i]) & 0xFF];
+	return ~crc;
+}
+
+static inline unsigned long long rotl64(unsigned long long x, int r) {
+	return (x << r) | (x >> (64 - r));
+}
+
+unsigned long long CheckSum::blockHash(int sequence, const unsigned char *buf, int len) {
+
+	//Multiply-rotate hash over 8-byte words, in the manner of xxHash64.
+	//The sequence number is mixed in first so that two blocks with the
+	//same contents still count separately in the file hash.
+	const unsigned long long p1 = 0x9E3779B185EBCA87ULL;
+	const unsigned long long p2 = 0xC2B2AE3D27D4EB4FULL;
+	const unsigned long long p3 = 0x165667B19E3779F9ULL;
+
+	unsigned long long h = p3 ^ ((unsigned long long)sequence * p1) ^ (unsigned)len;
+	int i = 0;
+	for(; i + 8 <= len; i += 8) {
+		unsigned long long word;
+		memcpy(&word, buf + i, 8);
+		h ^= rotl64(word * p2, 31) * p1;
+		h  = rotl64(h, 27) * p1 + p3;
+	}
+	for(; i < len; i++) {
+		h ^= buf[i] * p3;
+		h  = rotl64(h, 11) * p1;
+	}
+
+	//spread every input bit over the whole result
+	h ^= h >> 33;	h *= p2;
+	h ^= h >> 29;	h *= p3;
+	h ^= h >> 32;
+	return h;
+}
 
 unsigned char CheckSum::add(const unsigned char a, const unsigned char b) {
 	return a^b;
@@ -41,7 +131,8 @@ CheckSum::CheckSum(int pktSize) {
 
 	//Allocate the buffer.  
         //Note that pktSize includes the header and checksum fields.
-	buffer = new unsigned char[pktSize];
+	//verify() divides m(x) * x**4, so it needs four more bytes.
+	buffer = new unsigned char[pktSize+4];
 
 	//Generate the Galois field GF8.  Fill in the first eight by hand.
 	alpha[0] = 0x01;	alphaLog[0x01] = 0;
@@ -108,7 +199,19 @@ CheckSum::CheckSum(int pktSize) {
 }//end ctor
 
 
-void CheckSum::compute(unsigned char *pkt, const int pktLen) {
+void CheckSum::compute(unsigned char *pkt, const int pktLen, int tag) {
+
+	//The integrity and delta headers are checked with CRC32C instead,
+	//Big Endian
+	if(tag == tagIntegrity || tag == tagDelta) {
+		unsigned int crc = crc32c(pkt, pktLen-4);
+		if(tag == tagDelta) crc ^= crcDeltaTag;
+		pkt[pktLen-4] = crc >> 24;
+		pkt[pktLen-3] = crc >> 16;
+		pkt[pktLen-2] = crc >> 8;
+		pkt[pktLen-1] = crc;
+		return;
+	}
 
 	//Computes checksum using Galois Field arithmetic.  Each byte of the 
 	//packet is interpreted as a symbol in the finite field GF8.
@@ -167,13 +270,60 @@ void CheckSum::compute(unsigned char *pkt, const int pktLen) {
 	ptr1 = &pkt[ndx];//-4];
 	ptr2 = &buffer[ndx];
 
-	*ptr1++ = *ptr2++;
-	*ptr1++ = *ptr2++;
-	*ptr1++ = *ptr2++;
-	*ptr1++ = *ptr2++;
+	*ptr1++ = *ptr2++ ^ tags[tag][0];
+	*ptr1++ = *ptr2++ ^ tags[tag][1];
+	*ptr1++ = *ptr2++ ^ tags[tag][2];
+	*ptr1++ = *ptr2++ ^ tags[tag][3];
 
 }//end compute
 
+void CheckSum::remainder(int pktLen) {
+
+	//Same division as compute(), applied to the copy of the packet already
+	//in 'buffer'.  The remainder ends up in the last four bytes.
+	memset(buffer+pktLen-4,0,4);
+	for(int ndx = 0; ndx < pktLen-4; ndx++) {
+		unsigned char msb = buffer[ndx];
+		buffer[ndx+1] ^= lut[msb][3];
+		buffer[ndx+2] ^= lut[msb][2];
+		buffer[ndx+3] ^= lut[msb][1];
+		buffer[ndx+4] ^= lut[msb][0];
+	}
+}
+
+int CheckSum::identify(const unsigned char *pkt, int pktLen) {
+
+	//Reject packets that are all the same color, as verify() does, before
+	//going to any trouble over them.
+	bool multiValued = false;
+	for(int i=1; i<pktLen; i++)
+		if(pkt[i] != pkt[0]) {
+			multiValued = true; break;
+		}
+	if(!multiValued) return -1;
+
+	//A CRC32C is cheap enough to try first
+	const unsigned char *rcvd = pkt + pktLen - 4;
+	unsigned int crc = crc32c(pkt, pktLen-4);
+	unsigned int got = (rcvd[0] << 24) | (rcvd[1] << 16) | (rcvd[2] << 8) | rcvd[3];
+	if(got == crc)                 return tagIntegrity;
+	if(got == (crc ^ crcDeltaTag)) return tagDelta;
+
+	//Recompute the check bytes and compare them with the ones received.
+	//The difference is the tag the packet was built with.
+	memcpy(buffer,pkt,pktLen);	//Don't destroy the caller's buffer. 
+	remainder(pktLen);
+	const unsigned char *calc = buffer + pktLen - 4;
+	for(int tag = 0; tag < tagIntegrity; tag++) {
+		if((rcvd[0] ^ calc[0]) == tags[tag][0] &&
+		   (rcvd[1] ^ calc[1]) == tags[tag][1] &&
+		   (rcvd[2] ^ calc[2]) == tags[tag][2] &&
+		   (rcvd[3] ^ calc[3]) == tags[tag][3])
+			return tag;
+	}
+	return -1;
+}//end identify
+
 bool CheckSum::verify(const unsigned char *pkt, int pktLen) {
 	memcpy(buffer,pkt,pktLen);	//Don't destroy the caller's buffer. 
     
@@ -230,7 +380,7 @@ void CheckSum::PrintTables(const char *dumpFile) {
 	fprintf(fp,"Galois Field Generator Program v0.3 (October, 2005)");
 	fprintf(fp,"\n\n");
 	fprintf(fp,"Exponent\t\tSymbol\n");
-	for(int i=0;i<=255;i++) 
+	for(int i=0;i<255;i++) 
 		fprintf(fp,"alpha[%d]\t\t%x\n",i,alpha[i]);
 
 	fprintf(fp,"\n\nSymbol\t\tLogarithm\n");
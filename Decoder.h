@@ -0,0 +1,34 @@
+//Decoder.h - decodes frames held in memory, for applications using libpxit
+#ifndef DECODER_H
+#define DECODER_H
+#include "ImageProcessor.h"
+#include "OutputSink.h"
+
+/* A Decoder takes frames as width x height arrays of 0xAARRGGBB pixels, row
+ * by row from the top, and passes the files it reassembles to an
+ * OutputSink.  It keeps no global state and touches no files, so any number
+ * of them can run in one process (one per thread).
+ *
+ *     class MySink : public OutputSink {...};
+ *     MySink sink;
+ *     Decoder decoder(&sink);
+ *     while(getFrame(frame)) decoder.decode(frame);
+ */
+class Decoder {
+public:
+    Decoder(OutputSink *sink);
+    ~Decoder();
+
+    //1 if the frame held a valid packet, 0 if not, -1 if not after earlier
+    //ones did
+    int decode(const int *frame);
+
+    Metrics *getMetrics()      {return processor->getMetrics();}
+    long     blocksRemaining() {return processor->blocksRemaining();}
+    int      sessionsActive()  {return processor->sessionsActive();}
+
+private:
+    ImageProcessor *processor;
+};
+
+#endif // DECODER_H
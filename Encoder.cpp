@@ -0,0 +1,371 @@
+//Encoder.cpp - builds packets from file blocks and paints them as frames
+
+/*Copyright (c) 2020, Frank J. LoPinto
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.*/
+
+#include <string.h>
+#include "Encoder.h"
+#include "GridAligner.h"
+
+Encoder::Encoder(long long Filesize, bool Fiducials, bool Extended, unsigned int Id,
+                 int Palette, bool Integrity, long long BaseId, bool Banded) {
+    filesize  = Filesize;
+    fiducials = Fiducials;
+    banded    = Banded;
+    baseId    = BaseId;
+    integrity = Integrity || baseId >= 0;
+    extended  = Extended || integrity;
+    id        = Id;
+    palette   = Palette;
+    fileHashValue = 0;
+    ranges    = NULL;
+    nranges   = 0;
+    manifestFrames = 0;
+
+    //Fiducials take cells away from the packet, the longer headers
+    //take them from the data.  Bands divide the frame between packets.
+    pktSize = banded ? (fiducials ? fidBandPacketSize : bandPacketSize) :
+                       (fiducials ? fidPacketSize : packetSize);
+    hdrSize = baseId >= 0 ? deltaHeaderSize :
+              integrity   ? integHeaderSize : extended ? extHeaderSize : headerSize;
+    blkSize = pktSize - hdrSize - csumSize;
+
+	//Compute the number of images as needed to encode the file
+	framesNeeded = filesize / blkSize; 
+	if (blkSize * (long long)framesNeeded < filesize) 
+        framesNeeded++;  //The last frame will be partially filled
+
+    //create an object that can compute error-correcting codes
+	checksum = new CheckSum(packetSize);
+    memset(pixelstream, 0, ncells);    //cells beyond the packet stay red
+}
+
+Encoder::~Encoder() {
+    delete checksum;
+    delete [] ranges;
+}
+
+void Encoder::setChanged(const bool *changed) {
+
+    //Runs of changed blocks, as few ranges as possible
+    delete [] ranges;
+    ranges = new int[framesNeeded + 1];
+    nranges = 0;
+    for(int seq=0; seq<framesNeeded; seq++) {
+        if(!changed[seq]) continue;
+        if(nranges && ranges[2*nranges-2] + ranges[2*nranges-1] == seq)
+            ranges[2*nranges-1]++;
+        else {
+            ranges[2*nranges]   = seq;
+            ranges[2*nranges+1] = 1;
+            nranges++;
+        }
+    }
+
+    //An unchanged file still needs one manifest to say so
+    int perPart = (blkSize - 4) / 6;
+    manifestFrames = nranges ? (nranges + perPart - 1) / perPart : 1;
+}
+
+int Encoder::manifest(int part, unsigned char *data) {
+    int perPart = (blkSize - 4) / 6;
+    int first = part * perPart;
+    int n = nranges - first < perPart ? nranges - first : perPart;
+    if(n < 0) n = 0;
+
+    //parts and ranges, then first and count of each range, Big Endian
+    memset(data, 0, blkSize);
+    data[0] = manifestFrames >> 8;
+    data[1] = manifestFrames;
+    data[2] = n >> 8;
+    data[3] = n;
+    for(int i=0; i<n; i++) {
+        unsigned char *r = data + 4 + 6*i;
+        int seq = ranges[2*(first+i)], count = ranges[2*(first+i)+1];
+        r[0] = seq >> 16;   r[1] = seq >> 8;   r[2] = seq;
+        r[3] = count >> 16; r[4] = count >> 8; r[5] = count;
+    }
+    return blkSize;
+}
+
+unsigned int Encoder::hash(const unsigned char *buf, long len, unsigned int h) {
+    for(long i=0;i<len;i++) h = (h ^ buf[i]) * 16777619u;
+    return h;
+}
+
+unsigned int Encoder::hashFile(FILE *fp) {
+    unsigned int h = 2166136261u;
+    unsigned char buf[4096];
+    int n;
+    while((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+        h = hash(buf, n, h);
+    rewind(fp);
+    return h;
+}
+
+unsigned long long Encoder::hashBlocks(FILE *fp, int blkSize) {
+    unsigned long long h = 0;
+    unsigned char buf[packetSize];
+    int n;
+    for(int seq=0; (n = fread(buf, 1, blkSize, fp)) > 0; seq++)
+        h += CheckSum::blockHash(seq, buf, n);
+    rewind(fp);
+    return h;
+}
+
+unsigned long long Encoder::fileHash(const unsigned char *data) {
+    unsigned long long h = 0;
+    for(int seq=0; seq<framesNeeded; seq++) {
+        long long offset = (long long)seq*blkSize;
+        int len = filesize - offset < blkSize ? filesize - offset : blkSize;
+        h += CheckSum::blockHash(seq, data + offset, len);
+    }
+    return h;
+}
+
+int Encoder::encode(const unsigned char *data, FrameCallback callback, void *context,
+                    const bool *select) {
+    if(integrity) fileHashValue = fileHash(data);
+    int *frame = new int[width*height];
+    int n = 0, band = 0, first = 0, last = -1;
+    for(int seq=0; seq<framesNeeded; seq++) {
+        if(select && !select[seq]) continue;
+        long long offset = (long long)seq*blkSize;
+        int len = filesize - offset < blkSize ? filesize - offset : blkSize;
+        render(seq, data + offset, len, frame, band);
+        if(band == 0) first = seq;
+        last = seq;
+        if(++band < getBandsPerFrame()) continue;
+        callback(context, first, frame);
+        band = 0;
+        n++;
+    }
+
+    //Bands left over in the last frame repeat its last block
+    if(band > 0) {
+        long long offset = (long long)last*blkSize;
+        int len = filesize - offset < blkSize ? filesize - offset : blkSize;
+        while(band < getBandsPerFrame()) render(last, data + offset, len, frame, band++);
+        callback(context, first, frame);
+        n++;
+    }
+    delete [] frame;
+    return n;
+}
+
+int Encoder::cellSymbol(int cell, int band, bool *paint) {
+
+    //A banded packet occupies its band's share of the cells.  Cells left
+    //over after the last band stay red.
+    if(!banded) {
+        *paint = true;
+        return pixelstream[cell];
+    }
+    int bandCells = pktSize*4;
+    *paint = cell / bandCells == band || cell >= nBands*bandCells;
+    return cell >= nBands*bandCells ? 0 : pixelstream[cell - band*bandCells];
+}
+
+void Encoder::render(int blockSequence, const unsigned char *data, int len, int *frame,
+                     int band) {
+
+    getPixelstream(blockSequence, data, len);
+    
+    /* Now create the image by assigning colors to the squares based on the array 
+     * pixelstream.  The image will display a 45x30 array of color cells.
+     * Fiducial cells are skipped over by the pixelstream.
+     */
+
+	int cell = 0;
+	
+    for (int cy = 0; cy < nrows; cy++) {            //for every row
+        for (int cx = 0; cx < ncols; cx++) {        //for every colums
+            if(fiducials && GridAligner::isFiducialCell(cy, cx)) {
+                paintCell(frame, cy, cx, GridAligner::fiducialColor(cy, cx));
+                continue;
+            }
+            bool paint;
+            int symbol = cellSymbol(cell, band, &paint);
+            if(paint) drawCell(frame, cy, cx, symbol);    //draw a solid square
+            cell++;
+        }
+    }
+}
+
+void Encoder::renderYUV(int blockSequence, const unsigned char *data, int len,
+                        unsigned char *yuv, int band) {
+
+    //Cells are a whole number of chroma samples wide and high, so every
+    //cell is painted directly in all three planes
+    getPixelstream(blockSequence, data, len);
+
+	int cell = 0;
+    for (int cy = 0; cy < nrows; cy++) {
+        for (int cx = 0; cx < ncols; cx++) {
+            if(fiducials && GridAligner::isFiducialCell(cy, cx)) {
+                paintCellYUV(yuv, cy, cx, GridAligner::fiducialColor(cy, cx));
+                continue;
+            }
+            bool paint;
+            int symbol = cellSymbol(cell, band, &paint);
+            if(paint) paintCellYUV(yuv, cy, cx, symbolColor[palette][symbol]);
+            cell++;
+        }
+    }
+}
+
+const char *Encoder::getPixelstream(int blockSequence, const unsigned char *data, int len) {
+
+	memset(packet, 0, pktSize);
+
+    if(extended) {
+        //transfer id, file length and a three-byte offset, Big Endian
+        packet[0]  = id >> 24;
+        packet[1]  = id >> 16;
+        packet[2]  = id >> 8;
+        packet[3]  = id;
+        packet[4]  = filesize >> 24;
+        packet[5]  = filesize >> 16;
+        packet[6]  = filesize >> 8;
+        packet[7]  = filesize;
+        packet[8]  = blockSequence >> 16;
+        packet[9]  = blockSequence >> 8;
+        packet[10] = blockSequence;
+
+        //then the file hash, Big Endian
+        if(integrity)
+            for(int i=0;i<8;i++) packet[11+i] = fileHashValue >> (56 - 8*i);
+
+        //and for a delta, the id of the version it applies to
+        if(baseId >= 0) {
+            packet[19] = baseId >> 24;
+            packet[20] = baseId >> 16;
+            packet[21] = baseId >> 8;
+            packet[22] = baseId;
+        }
+    } else {
+	    //write the file length Big Endian
+	    packet[0] = filesize >> 16;
+	    packet[1] = filesize >> 8;
+	    packet[2] = filesize;
+
+	    //now convert frameNumber into a two-byte offset.
+	    packet[3] = (blockSequence >> 8) & 0xFF;
+	    packet[4] = blockSequence & 0xFF;
+    }
+
+    //Copy the data block following the header.  A short last block stays
+    //padded with zeros.
+    if(len > blkSize) len = blkSize;
+    memcpy(packet+hdrSize, data, len);
+    
+    //Compute checksum
+    checksum->compute(packet, pktSize, baseId >= 0 ? tagDelta :
+                                       integrity ? tagIntegrity :
+                                       extended  ? tagExtended  : tagNone);
+   
+   /* At this point we have a complete date packet.  We now have to 
+    * "paint a picture".  The packet is a sequence of bytes.  Each byte
+    * is a sequence of four two-bit symbols.  The symbols are one digit
+    * numbers in the Base 4 system: 00, 01, 10, 11.  The numerals we
+    * use are actually colors: red, white, blue, and green, respectively.
+    * We call this stream of colors a 'pixelstream'.
+    */
+
+	int cell = 0;
+	for (int i = 0; i < pktSize; i++) {
+        
+        const int b1 = 4;		//  4s place
+        const int b2 = b1 * 4;	// 16s place
+        const int b3 = b2 * 4;	// 64s place
+		int base4digit[4];
+
+        //start with a byte
+		int byte = packet[i];
+
+		//convert the byte into four base 4 base4digita
+		base4digit[0] = byte / b3;
+		byte -= b3*base4digit[0];
+
+		base4digit[1] = byte / b2;
+		byte -= b2*base4digit[1];
+
+		base4digit[2] = byte / b1;
+		byte -= b1*base4digit[2];
+
+		base4digit[3] = byte;
+
+		pixelstream[cell]	  = (unsigned char)base4digit[0];
+		pixelstream[cell + 1] = (unsigned char)base4digit[1];
+		pixelstream[cell + 2] = (unsigned char)base4digit[2];
+		pixelstream[cell + 3] = (unsigned char)base4digit[3];
+
+		cell += 4;
+	}
+    return pixelstream;
+}
+
+void Encoder::drawCell(int *frame, int row_, int col_, int value) {
+
+    //value is the 2-bit symbol the cell should represent
+    paintCell(frame, row_, col_, symbolColor[palette][value & 3]);
+}
+
+void Encoder::paintCell(int *frame, int row_, int col_, int pxvalue) {
+
+	//Note: (row_, col_) refer to rows and columns in the rectangular array of cells.
+	//      (row , col ) refer to pixel coordinates within an image.
+
+    //convert cell array coordinates to image pixel coordinates
+	int row = row_*cellsize;
+	int col = col_*cellsize;
+
+    //Color in the cell
+	for (int r = row; r<row + cellsize; r++) {
+		for (int c = col; c<col + cellsize; c++) {
+			*(frame + r*width + c) = pxvalue;
+		}
+	}
+}
+
+void Encoder::paintCellYUV(unsigned char *yuv, int row_, int col_, unsigned int pxvalue) {
+    int red = (pxvalue >> 16) & 0xFF;
+    int grn = (pxvalue >>  8) & 0xFF;
+    int blu = (pxvalue      ) & 0xFF;
+
+    //BT.601 with luma in 16..235 and chroma in 16..240
+    unsigned char y  = (unsigned char)(16.5  + ( 65.481*red + 128.553*grn +  24.966*blu) / 255);
+    unsigned char cb = (unsigned char)(128.5 + (-37.797*red -  74.203*grn + 112.000*blu) / 255);
+    unsigned char cr = (unsigned char)(128.5 + (112.000*red -  93.786*grn -  18.214*blu) / 255);
+
+    int row = row_*cellsize;
+    int col = col_*cellsize;
+    for (int r = row; r<row + cellsize; r++)
+        memset(yuv + r*width + col, y, cellsize);
+
+    unsigned char *u = yuv + width*height;
+    unsigned char *v = u + width*height/4;
+    for (int r = row/2; r<(row + cellsize)/2; r++) {
+        memset(u + r*width/2 + col/2, cb, cellsize/2);
+        memset(v + r*width/2 + col/2, cr, cellsize/2);
+    }
+}
@@ -0,0 +1,111 @@
+//Encoder.h - turns blocks of a file into pxit frames
+#ifndef ENCODER_H
+#define ENCODER_H
+#include <stdio.h>
+#include "checksum.h"
+#include "pxit-parms.h"
+
+/* An Encoder is set up once per file with its length, layout options and
+ * (for the extended header) its transfer id.  render() then builds the
+ * packet for one block, computes its checksum and paints the cells into a
+ * width x height bitmap of 0xAARRGGBB pixels.  Reading the file and saving
+ * the frames is left to the caller.
+ *
+ * For a file held in memory, encode() renders every frame (or a selection)
+ * in turn and hands each one to a callback.
+ *
+ * With the integrity header every frame also carries the file hash, which
+ * the caller sets before rendering: the sum of CheckSum::blockHash() over
+ * the blocks (fileHash() computes it for a file in memory, hashBlocks()
+ * for an open one).
+ *
+ * A delta Encoder (baseId >= 0) sends a new version of a file to receivers
+ * that already hold the version with transfer id baseId.  The caller flags
+ * the blocks that differ with setChanged(), renders the manifest packets
+ * (render(manifestBase + part, data, manifest(part, data), frame)) and then
+ * only the changed blocks.  Delta implies the integrity header.
+ *
+ * A banded Encoder puts getBandsPerFrame() packets in each frame (see
+ * pxit-parms.h).  render() then paints one block into the given band and
+ * leaves the rest of the frame alone, so the caller renders a block into
+ * every band before saving the frame.
+ */
+
+//The frame passed to a FrameCallback is only valid during the call
+typedef void (*FrameCallback)(void *context, int sequence, const int *frame);
+
+class Encoder {
+public:
+    Encoder(long long filesize, bool fiducials, bool extended, unsigned int id = 0,
+            int palette = paletteStandard, bool integrity = false, long long baseId = -1,
+            bool banded = false);
+    ~Encoder();
+
+    int  getBlockSize()    {return blkSize;}
+    int  getPacketSize()   {return pktSize;}
+    int  getFramesNeeded() {return framesNeeded;}   //blocks, one per packet
+    int  getBandsPerFrame() {return banded ? nBands : 1;}
+    void setFileHash(unsigned long long h) {fileHashValue = h;}
+    unsigned long long fileHash(const unsigned char *data);
+
+    //delta: changed has getFramesNeeded() entries, true for blocks that
+    //differ from the base version
+    void setChanged(const bool *changed);
+    int  getManifestFrames() {return manifestFrames;}
+    int  manifest(int part, unsigned char *data);  //fills a block, returns its length
+
+    //data holds up to getBlockSize() bytes of block 'sequence'
+    void render(int sequence, const unsigned char *data, int len, int *frame, int band = 0);
+
+    //the same as render(), but straight to a planar YCbCr 4:2:0 frame
+    //(BT.601, studio range): width*height luma samples, then Cb and Cr
+    void renderYUV(int sequence, const unsigned char *data, int len, unsigned char *yuv,
+                   int band = 0);
+
+    //render the blocks of data[0..filesize) flagged in select (all if NULL),
+    //returning the number of frames
+    int  encode(const unsigned char *data, FrameCallback callback, void *context,
+                const bool *select = NULL);
+
+    //the 2-bit symbols render() would paint, one per data cell
+    const char *getPixelstream(int sequence, const unsigned char *data, int len);
+
+    //32-bit FNV-1a, in pieces: pass the previous result to continue
+    static unsigned int hash(const unsigned char *buf, long len,
+                             unsigned int h = 2166136261u);
+
+    //the transfer id of a whole file: hash() of its contents.  The file is
+    //rewound afterwards.
+    static unsigned int hashFile(FILE *fp);
+
+    //fileHash() of a file read in blocks of blkSize, also rewound
+    static unsigned long long hashBlocks(FILE *fp, int blkSize);
+
+private:
+    CheckSum     *checksum;
+    long long     filesize;
+    unsigned int  id;
+    bool          fiducials;
+    bool          extended;
+    bool          integrity;          //integrity header (implies extended)
+    long long     baseId;             //delta: id of the previous version, else -1
+    bool          banded;             //a packet in each band of the frame
+    int          *ranges;             //delta: first and count of each run of changed blocks
+    int           nranges;
+    int           manifestFrames;
+    unsigned long long fileHashValue;
+    int           palette;
+    int           pktSize;
+    int           hdrSize;
+    int           blkSize;
+    int           framesNeeded;
+    unsigned char packet[packetSize];   //packet we're building
+    char          pixelstream[ncells];  //color cell representation of packet
+
+    void drawCell(int *frame, int row_, int col_, int value);
+    void paintCell(int *frame, int row_, int col_, int pxvalue);
+    void paintCellYUV(unsigned char *yuv, int row_, int col_, unsigned int pxvalue);
+    int  cellSymbol(int cell, int band, bool *paint);
+};
+
+#endif // ENCODER_H
@@ -0,0 +1,84 @@
+//FrameCache.cpp - size-bounded cache of rendered frames
+
+/*Copyright (c) 2020, Frank J. LoPinto
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.*/
+
+#include <string.h>
+#include "FrameCache.h"
+
+FrameCache::FrameCache(long long maxBytes, int FrameBytes) {
+    frameBytes = FrameBytes;
+    nEntries = maxBytes / frameBytes;
+    if(nEntries < 1) nEntries = 1;
+    nUsed = 0;
+    keys = new unsigned long long[nEntries];
+    frames = new unsigned char[(long long)nEntries*frameBytes];
+
+    //Keep the table at most half full so searches stay short
+    tableSize = 1;
+    while(tableSize < 2*nEntries) tableSize <<= 1;
+    table = new int[tableSize];
+    for(int i=0;i<tableSize;i++) table[i] = -1;
+
+    hits = misses = 0;
+}
+
+FrameCache::~FrameCache() {
+    delete [] keys;
+    delete [] frames;
+    delete [] table;
+}
+
+int FrameCache::home(unsigned long long key) {
+    return (int)((key * 0x9E3779B97F4A7C15ULL) >> 32) & (tableSize - 1);
+}
+
+int FrameCache::slot(unsigned long long key) {
+
+    //The place in the table that holds the key, or the empty place
+    //where it would go
+    int i = home(key);
+    while(table[i] >= 0 && keys[table[i]] != key)
+        i = (i + 1) & (tableSize - 1);
+    return i;
+}
+
+unsigned char *FrameCache::find(unsigned long long key) {
+    int e = table[slot(key)];
+    if(e < 0) {
+        misses++;
+        return NULL;
+    }
+    hits++;
+    return frames + (long long)e*frameBytes;
+}
+
+unsigned char *FrameCache::insert(unsigned long long key) {
+
+    //Frames already cached stay, see FrameCache.h
+    if(nUsed == nEntries) return NULL;
+
+    int e = nUsed++;
+    keys[e] = key;
+    table[slot(key)] = e;
+    return frames + (long long)e*frameBytes;
+}
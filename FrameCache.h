@@ -0,0 +1,42 @@
+//FrameCache.h - keeps rendered frames for reuse, up to a size limit
+#ifndef FRAMECACHE_H
+#define FRAMECACHE_H
+
+/* Frames are identified by a key chosen by the caller and all have the same
+ * size.  find() returns NULL for a frame that isn't cached; insert()
+ * returns a buffer for the caller to render it into.
+ *
+ * A carousel goes through the same frames in the same order on every
+ * pass, which is the worst case for giving up the frame used least
+ * recently: once there are more frames than room, each one is given up
+ * just before it is needed again and nothing is ever found.  So frames
+ * are never given up.  The first ones to arrive stay until the cache is
+ * deleted, and once it is full insert() returns NULL and the caller
+ * renders into a buffer of its own.  Every pass then finds as many frames
+ * as the cache holds.
+ */
+class FrameCache {
+public:
+    FrameCache(long long maxBytes, int frameBytes);
+    ~FrameCache();
+
+    unsigned char *find(unsigned long long key);
+    unsigned char *insert(unsigned long long key);  //NULL when full
+    int            capacity() {return nEntries;}
+
+    long hits, misses;
+
+private:
+    int                 nEntries;
+    int                 nUsed;
+    unsigned long long *keys;       //of the frames, by entry
+    unsigned char      *frames;     //nEntries frames of frameBytes
+    int                 frameBytes;
+    int                *table;      //hash table of entry numbers, -1 if empty
+    int                 tableSize;  //a power of two
+
+    int  home(unsigned long long key);
+    int  slot(unsigned long long key);
+};
+
+#endif // FRAMECACHE_H
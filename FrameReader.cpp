@@ -0,0 +1,145 @@
+//FrameReader.cpp - reads a list of TARGA files ahead of the decoder
+
+/*Copyright (c) 2020, Frank J. LoPinto
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "FrameReader.h"
+#include "TargaImage.h"
+#include "pxit-parms.h"
+
+FrameReader::FrameReader(char **Names, int Count, int Depth) {
+    names    = Names;
+    count    = Count;
+    depth    = Depth < 2 ? 2 : Depth;
+    loaded   = 0;
+    taken    = 0;
+    released = 0;
+    stop     = false;
+
+    //Cache-line aligned, so the classifier's row reads don't straddle lines
+    frames = new int *[depth];
+    images = new TargaImage *[depth];
+    valid  = new bool[depth];
+    for(int i=0; i<depth; i++) {
+        void *p;
+        if(posix_memalign(&p, 64, width*height*sizeof(int)) != 0) {
+            perror("FrameReader");
+            exit(1);
+        }
+        frames[i] = (int *)p;
+        images[i] = new TargaImage(width, height, frames[i]);
+    }
+
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&changed, NULL);
+
+    //The first files are needed right away
+    for(int i=0; i<depth && i<count; i++) advise(i);
+    pthread_create(&thread, NULL, run, this);
+}
+
+FrameReader::~FrameReader() {
+    pthread_mutex_lock(&lock);
+    stop = true;
+    pthread_cond_broadcast(&changed);
+    pthread_mutex_unlock(&lock);
+    pthread_join(thread, NULL);
+
+    pthread_cond_destroy(&changed);
+    pthread_mutex_destroy(&lock);
+    for(int i=0; i<depth; i++) {
+        delete images[i];
+        free(frames[i]);
+    }
+    delete [] images;
+    delete [] frames;
+    delete [] valid;
+}
+
+int *FrameReader::next(const char **name, bool *whole) {
+    pthread_mutex_lock(&lock);
+
+    //The frame handed out last time is finished with, so its buffer can
+    //take the next file
+    released = taken;
+    pthread_cond_broadcast(&changed);
+
+    int *frame = NULL;
+    while(!frame && taken < count) {
+        while(loaded <= taken) pthread_cond_wait(&changed, &lock);
+        int slot = taken % depth;
+        if(valid[slot]) {
+            frame = frames[slot];
+            if(name)  *name  = names[taken];
+            if(whole) *whole = images[slot]->isComplete();
+        } else {
+            released = taken + 1;           //skip unreadable files
+            pthread_cond_broadcast(&changed);
+        }
+        taken++;
+    }
+
+    pthread_mutex_unlock(&lock);
+    return frame;
+}
+
+void *FrameReader::run(void *reader) {
+    ((FrameReader *)reader)->readAll();
+    return NULL;
+}
+
+void FrameReader::readAll() {
+    for(int i=0; i<count; i++) {
+
+        //Wait for a free buffer
+        pthread_mutex_lock(&lock);
+        while(i - released >= depth && !stop) pthread_cond_wait(&changed, &lock);
+        bool quit = stop;
+        pthread_mutex_unlock(&lock);
+        if(quit) return;
+
+        //Only this thread touches the buffer until the file is marked loaded
+        int slot = i % depth;
+        bool ok = images[slot]->read(names[i]);
+
+        //Keep the disk busy with a file we'll want shortly
+        if(i + depth < count) advise(i + depth);
+
+        pthread_mutex_lock(&lock);
+        valid[slot] = ok;
+        loaded = i + 1;
+        pthread_cond_broadcast(&changed);
+        pthread_mutex_unlock(&lock);
+    }
+}
+
+void FrameReader::advise(int file) {
+    //Start reading the file into the page cache without waiting for it
+    int fd = open(names[file], O_RDONLY);
+    if(fd < 0) return;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    close(fd);
+}
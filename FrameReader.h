@@ -0,0 +1,43 @@
+//FrameReader.h - reads a list of TARGA files ahead of the decoder
+#ifndef FRAMEREADER_H
+#define FRAMEREADER_H
+#include <pthread.h>
+
+class TargaImage;
+
+/* A thread reads the images into a small pool of frame buffers while the
+ * caller decodes the one before, and asks the kernel to start reading the
+ * files after that.  The buffers are allocated once and reused, so decoding
+ * a directory costs no allocation per image.  next() returns the frames in
+ * order; each one stays valid until the following call.  Files that can't
+ * be read are skipped.  One that ends early is returned with the rest of
+ * its frame black and whole set false.
+ */
+class FrameReader {
+public:
+    FrameReader(char **names, int count, int depth = 4);
+    ~FrameReader();
+
+    int *next(const char **name, bool *whole = NULL);  //NULL after the last file
+
+private:
+    char          **names;
+    int             count;
+    int             depth;          //number of frame buffers
+    int           **frames;
+    TargaImage    **images;         //read files into frames
+    bool           *valid;          //frames[i] holds a readable image
+    int             loaded;         //files read by the thread
+    int             taken;          //frames handed to the caller
+    int             released;       //frames the caller is finished with
+    bool            stop;
+    pthread_mutex_t lock;
+    pthread_cond_t  changed;
+    pthread_t       thread;
+
+    static void *run(void *reader);
+    void readAll();
+    void advise(int file);
+};
+
+#endif // FRAMEREADER_H
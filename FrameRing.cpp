@@ -0,0 +1,249 @@
+//FrameRing.cpp - a ring of frames in shared memory, from grabbers to pxit-ingest
+
+/*Copyright (c) 2020, Frank J. LoPinto
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include "FrameRing.h"
+#include "pxit-parms.h"
+
+static long futex(uint32_t *word, int op, uint32_t value, const struct timespec *timeout) {
+    return syscall(SYS_futex, word, op, value, timeout, NULL, 0);
+}
+
+FrameRing::FrameRing(RingHeader *Header, long long Size, const char *Name) {
+    header = Header;
+    size   = Size;
+    strncpy(name, Name, sizeof(name)-1);
+    name[sizeof(name)-1] = 0;
+}
+
+FrameRing::~FrameRing() {
+    munmap(header, size);
+}
+
+FrameRing *FrameRing::create(const char *name, int nslots) {
+    long page = sysconf(_SC_PAGESIZE);
+    uint32_t dataOffset = (sizeof(RingHeader) + page - 1) / page * page;
+    uint32_t slotBytes  = (sizeof(SlotHeader) + width*height*sizeof(int) + page - 1) / page * page;
+    long long size = dataOffset + (long long)nslots*slotBytes;
+
+    //A ring left by an earlier run may have the wrong size, so start over,
+    //unless its consumer is still running: its producers would carry on
+    //with the old ring and never reach the new one
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0666);
+    if(fd < 0 && errno == EEXIST) {
+        pid_t pid = consumer(name);
+        if(pid) {
+            printf("%s is in use by process %d\n", name, (int)pid);
+            return NULL;
+        }
+        shm_unlink(name);
+        fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0666);
+    }
+    if(fd < 0) {
+        perror(name);
+        return NULL;
+    }
+    struct stat st;
+    if(ftruncate(fd, size) < 0 || fstat(fd, &st) < 0) {
+        perror("ftruncate");
+        close(fd);
+        shm_unlink(name);
+        return NULL;
+    }
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(p == MAP_FAILED) {
+        perror("mmap");
+        shm_unlink(name);
+        return NULL;
+    }
+
+    //The new object is all zeros; fill in the header and slots, and only
+    //then the magic number that tells producers it's ready
+    RingHeader *h = (RingHeader *)p;
+    h->version    = ringVersion;
+    h->width      = width;
+    h->height     = height;
+    h->nslots     = nslots;
+    h->slotBytes  = slotBytes;
+    h->dataOffset = dataOffset;
+    h->consumer   = getpid();
+    FrameRing *ring = new FrameRing(h, size, name);
+    ring->dev = st.st_dev;
+    ring->ino = st.st_ino;
+    for(int i=0; i<nslots; i++) ring->slot(i)->sequence = i;
+    __atomic_store_n(&h->magic, ringMagic, __ATOMIC_RELEASE);
+    return ring;
+}
+
+//consumer() returns the process id of the running consumer of an existing
+//ring, or 0 if there is none
+pid_t FrameRing::consumer(const char *name) {
+    int fd = shm_open(name, O_RDONLY, 0);
+    if(fd < 0) return 0;
+    struct stat st;
+    RingHeader *h = NULL;
+    if(fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(RingHeader)) {
+        void *p = mmap(NULL, sizeof(RingHeader), PROT_READ, MAP_SHARED, fd, 0);
+        if(p != MAP_FAILED) h = (RingHeader *)p;
+    }
+    close(fd);
+    if(!h) return 0;
+
+    pid_t pid = 0;
+    if(__atomic_load_n(&h->magic, __ATOMIC_ACQUIRE) == ringMagic && h->consumer &&
+       (kill(h->consumer, 0) == 0 || errno == EPERM))
+        pid = h->consumer;
+    munmap(h, sizeof(RingHeader));
+    return pid;
+}
+
+FrameRing *FrameRing::open(const char *name) {
+    int fd = shm_open(name, O_RDWR, 0);
+    if(fd < 0) {
+        perror(name);
+        return NULL;
+    }
+    struct stat st;
+    if(fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(RingHeader)) {
+        printf("%s is not a frame ring\n", name);
+        close(fd);
+        return NULL;
+    }
+    void *p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(p == MAP_FAILED) {
+        perror("mmap");
+        return NULL;
+    }
+
+    RingHeader *h = (RingHeader *)p;
+    if(__atomic_load_n(&h->magic, __ATOMIC_ACQUIRE) != ringMagic || h->version != ringVersion ||
+       h->width != (uint32_t)width || h->height != (uint32_t)height ||
+       h->dataOffset + (long long)h->nslots*h->slotBytes > st.st_size) {
+        printf("%s is not a frame ring this program understands\n", name);
+        munmap(p, st.st_size);
+        return NULL;
+    }
+    FrameRing *ring = new FrameRing(h, st.st_size, name);
+    ring->dev = st.st_dev;
+    ring->ino = st.st_ino;
+    return ring;
+}
+
+SlotHeader *FrameRing::slot(uint64_t position) {
+    return (SlotHeader *)((char *)header + header->dataOffset +
+                          (position % header->nslots) * header->slotBytes);
+}
+
+int *FrameRing::acquire(uint64_t *ticket) {
+    uint64_t pos = __atomic_load_n(&header->head, __ATOMIC_RELAXED);
+    for(;;) {
+        SlotHeader *s = slot(pos);
+        uint64_t seq = __atomic_load_n(&s->sequence, __ATOMIC_ACQUIRE);
+        if(seq == pos) {
+            //The slot is free; claim it unless another producer got there first
+            if(__atomic_compare_exchange_n(&header->head, &pos, pos + 1, true,
+                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                *ticket = pos;
+                return (int *)(s + 1);
+            }
+        } else if(seq < pos) {
+            //Full.  Nobody would ever empty it if the consumer is gone.
+            if(!alive()) {
+                errno = EPIPE;
+                return NULL;
+            }
+            __atomic_add_fetch(&header->dropped, 1, __ATOMIC_RELAXED);
+            errno = EAGAIN;
+            return NULL;
+        } else {
+            pos = __atomic_load_n(&header->head, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+//alive() is true while the process that created the ring is running and
+//the ring's name still refers to it
+bool FrameRing::alive() {
+    pid_t pid = __atomic_load_n(&header->consumer, __ATOMIC_RELAXED);
+    if(!pid || (kill(pid, 0) < 0 && errno != EPERM)) return false;
+
+    int fd = shm_open(name, O_RDONLY, 0);
+    if(fd < 0) return false;
+    struct stat st;
+    bool same = fstat(fd, &st) == 0 && st.st_dev == dev && st.st_ino == ino;
+    close(fd);
+    return same;
+}
+
+void FrameRing::publish(uint64_t ticket) {
+    __atomic_store_n(&slot(ticket)->sequence, ticket + 1, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&header->signal, 1, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&header->waiting, __ATOMIC_SEQ_CST))
+        futex(&header->signal, FUTEX_WAKE, 1, NULL);
+}
+
+const int *FrameRing::next(int timeoutMs) {
+    uint64_t pos = header->tail;
+    SlotHeader *s = slot(pos);
+    if(__atomic_load_n(&s->sequence, __ATOMIC_ACQUIRE) == pos + 1) return (int *)(s + 1);
+
+    //Nothing yet.  Say we're going to sleep, then look once more, so that
+    //a producer publishing in between either is seen or sees us waiting.
+    __atomic_store_n(&header->waiting, 1, __ATOMIC_SEQ_CST);
+    uint32_t signal = __atomic_load_n(&header->signal, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&s->sequence, __ATOMIC_ACQUIRE) != pos + 1) {
+        struct timespec timeout = {timeoutMs / 1000, (timeoutMs % 1000) * 1000000L};
+        futex(&header->signal, FUTEX_WAIT, signal, &timeout);
+    }
+    __atomic_store_n(&header->waiting, 0, __ATOMIC_SEQ_CST);
+
+    if(__atomic_load_n(&s->sequence, __ATOMIC_ACQUIRE) == pos + 1) return (int *)(s + 1);
+    return NULL;
+}
+
+void FrameRing::release() {
+    uint64_t pos = header->tail;
+    __atomic_store_n(&slot(pos)->sequence, pos + header->nslots, __ATOMIC_RELEASE);
+    __atomic_store_n(&header->tail, pos + 1, __ATOMIC_RELEASE);
+}
+
+void FrameRing::remove() {
+    shm_unlink(name);
+}
+
+uint64_t FrameRing::getDropped() {
+    return __atomic_load_n(&header->dropped, __ATOMIC_RELAXED);
+}
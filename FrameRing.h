@@ -0,0 +1,113 @@
+//FrameRing.h - a ring of frames in shared memory, from grabbers to pxit-ingest
+#ifndef FRAMERING_H
+#define FRAMERING_H
+#include <stdint.h>
+#include <sys/types.h>
+
+/* pxit-ingest creates the ring as a POSIX shared-memory object (shm_open)
+ * and decodes the frames other processes put into it.  Producers map the
+ * same object and draw or convert each frame straight into a slot, so a
+ * frame is never copied or encoded on its way to the decoder.  Any number
+ * of producers, in any number of processes, can share the ring.
+ *
+ *     FrameRing *ring = FrameRing::open("/pxit-ingest");
+ *     uint64_t ticket;
+ *     int *frame = ring->acquire(&ticket);    //NULL if full or abandoned
+ *     if(frame) {
+ *         ...fill in width x height 0xAARRGGBB pixels...
+ *         ring->publish(ticket);
+ *     } else if(errno == EPIPE) {
+ *         delete ring;                        //pxit-ingest went away
+ *         ring = FrameRing::open("/pxit-ingest");
+ *     }
+ *
+ * Layout.  All fields are native-endian; the object starts with a
+ * RingHeader, and slot i starts at dataOffset + i*slotBytes with a
+ * SlotHeader, followed by the pixels (row by row from the top) at offset
+ * 64.  dataOffset and slotBytes are multiples of the page size.
+ *
+ * Protocol (a bounded queue after Dmitry Vyukov's).  Slot i's sequence
+ * starts at i.  A producer reads head; if the slot at head % nslots has
+ * sequence == head, the producer owns it once it has advanced head by
+ * compare-and-swap.  It fills the slot in and stores sequence = head + 1
+ * with release ordering.  A sequence below head means the ring is full:
+ * the producer adds one to 'dropped' and gives up on that frame rather
+ * than wait.  The consumer takes the slot at tail once its sequence is
+ * tail + 1, and hands it back by storing sequence = tail + nslots.
+ *
+ * A producer that dies between acquire() and publish() leaves its slot
+ * claimed for good.  The consumer stops at that slot and the ring soon
+ * fills up; only restarting pxit-ingest, which makes a new ring, clears it.
+ * create() refuses to replace a ring whose consumer is still running.
+ *
+ * A consumer that exits or dies leaves its producers with a ring nobody
+ * empties, and a restarted one makes a new ring under the same name that
+ * they don't see.  So when the ring is full, acquire() also checks with
+ * alive() that the consumer is running and that the name still refers to
+ * this ring.  If not, it returns NULL with errno set to EPIPE rather than
+ * EAGAIN, and doesn't count the frame as dropped; the producer should
+ * open() the ring again, which fails until a consumer has made a new one.
+ *
+ * Wakeups use a futex on 'signal', which every publish increments.  The
+ * consumer sets 'waiting' before it sleeps, and producers only make the
+ * futex system call when it is set.
+ */
+
+const uint32_t ringMagic   = 0x50585247;    //"PXRG"
+const uint32_t ringVersion = 1;
+
+struct RingHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t width;             //pixels
+    uint32_t height;
+    uint32_t nslots;
+    uint32_t slotBytes;         //from the start of one slot to the next
+    uint32_t dataOffset;        //from the start of the object to slot 0
+    uint32_t waiting;           //1 while the consumer sleeps on 'signal'
+    uint32_t signal;            //futex word
+    uint32_t consumer;          //process id of the consumer
+    uint32_t reserved[6];
+    uint64_t head __attribute__ ((aligned(64)));    //next position to fill
+    uint64_t tail __attribute__ ((aligned(64)));    //next position to decode
+    uint64_t dropped;           //frames turned away because the ring was full
+};
+
+struct SlotHeader {
+    uint64_t sequence;
+    uint64_t reserved[7];
+};
+
+class FrameRing {
+public:
+    ~FrameRing();
+
+    //for the consumer: create the ring, replacing one left behind
+    static FrameRing *create(const char *name, int nslots);
+    //for producers: map a ring that pxit-ingest created
+    static FrameRing *open(const char *name);
+
+    int  *acquire(uint64_t *ticket);        //a slot to fill, NULL if full
+    void  publish(uint64_t ticket);
+    bool  alive();                          //false once the consumer is gone
+
+    const int *next(int timeoutMs);         //NULL if nothing came in time
+    void  release();                        //done with the frame from next()
+    void  remove();                         //unlink the shared-memory name
+
+    uint64_t getDropped();
+
+private:
+    FrameRing(RingHeader *header, long long size, const char *name);
+
+    RingHeader *header;
+    long long   size;
+    char        name[256];
+    dev_t       dev;                        //of the object mapped, to tell
+    ino_t       ino;                        //whether the name still refers to it
+
+    SlotHeader *slot(uint64_t position);
+    static pid_t consumer(const char *name);
+};
+
+#endif // FRAMERING_H
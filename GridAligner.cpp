@@ -0,0 +1,240 @@
+//GridAligner.cpp - finds fiducial cells and computes sample points
+
+/*Copyright (c) 2020, Frank J. LoPinto
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.*/
+
+#include <math.h>
+#include <string.h>
+#include "GridAligner.h"
+
+//The black cell of each fiducial block, in the order top-left, top-right,
+//bottom-left, bottom-right.
+static const int fidRow[4] = {1, 1, nrows-2, nrows-2};
+static const int fidCol[4] = {1, ncols-2, 1, ncols-2};
+
+//A first search looks for each fiducial in a square of this many pixels
+//in its corner of the frame.  Once the grid has been found, later frames
+//are searched in a smaller window around the previous positions.
+const int cornerSearch = 8*cellsize;
+const int trackSearch  = 2*cellsize;
+
+GridAligner::GridAligner() {
+    reset();
+}
+
+void GridAligner::reset() {
+    tracking = false;
+}
+
+bool GridAligner::isFiducialCell(int row, int col) {
+    return (row < 2 || row >= nrows-2) && (col < 2 || col >= ncols-2);
+}
+
+int GridAligner::fiducialColor(int row, int col) {
+    bool black = (row == 1 || row == nrows-2) && (col == 1 || col == ncols-2);
+    return black ? 0xFF000000 : 0xFFFFFFFF;
+}
+
+const int *GridAligner::getSampleOffsets() {return samples;}
+
+bool GridAligner::locate(const int *frame) {
+    double x[4], y[4];
+
+    for(int k=0;k<4;k++) {
+        bool found = false;
+
+        //Look near the last known position first
+        if(tracking) {
+            int cx = (int)(fx[k] + 0.5), cy = (int)(fy[k] + 0.5);
+            found = findBlob(frame, cx-trackSearch, cy-trackSearch,
+                             cx+trackSearch+1, cy+trackSearch+1, &x[k], &y[k]);
+        }
+
+        //Then search the whole corner
+        if(!found) {
+            int x0 = (fidCol[k] < ncols/2) ? 0 : width  - cornerSearch;
+            int y0 = (fidRow[k] < nrows/2) ? 0 : height - cornerSearch;
+            found = findBlob(frame, x0, y0, x0+cornerSearch, y0+cornerSearch,
+                             &x[k], &y[k]);
+        }
+
+        if(!found) {
+            tracking = false;
+            return false;
+        }
+    }
+
+    //The four points have to be arranged like the corners of the grid and
+    //roughly the right distance apart.
+    double span = (ncols-3) * cellsize;
+    double dx = x[1] - x[0];
+    if(x[0] >= x[1] || x[2] >= x[3] || y[0] >= y[2] || y[1] >= y[3] ||
+       dx < span/2 || dx > span*2) {
+        tracking = false;
+        return false;
+    }
+
+    if(!solve(x, y) || !mapSamples()) {
+        tracking = false;
+        return false;
+    }
+
+    memcpy(fx, x, sizeof(fx));
+    memcpy(fy, y, sizeof(fy));
+    tracking = true;
+    return true;
+}
+
+bool GridAligner::findBlob(const int *frame, int x0, int y0, int x1, int y1,
+                           double *cx, double *cy) {
+
+    //Find the largest dark region inside the window that does not touch the
+    //window's edge.  Black bars from blanking or shifted captures always
+    //touch the edge of the frame, so they are never mistaken for a fiducial.
+    if(x0 < 0) x0 = 0;
+    if(y0 < 0) y0 = 0;
+    if(x1 > width)  x1 = width;
+    if(y1 > height) y1 = height;
+    int w = x1 - x0, h = y1 - y0;
+    if(w <= 0 || h <= 0) return false;
+
+    const int minArea = cellsize*cellsize/8;
+    const int maxArea = cellsize*cellsize*4;
+
+    unsigned char dark[cornerSearch*cornerSearch];
+    int stack[cornerSearch*cornerSearch];
+
+    for(int r=0;r<h;r++) {
+        for(int c=0;c<w;c++) {
+            int pixelcolor = *(frame + width*(y0+r) + x0 + c);
+            int red = (pixelcolor >> 16) & 0xFF;
+            int grn = (pixelcolor >>  8) & 0xFF;
+            int blu = (pixelcolor      ) & 0xFF;
+            dark[r*w + c] = (red < 96 && grn < 96 && blu < 96);
+        }
+    }
+
+    int bestArea = 0;
+    for(int start=0;start<w*h;start++) {
+        if(!dark[start]) continue;
+
+        //Flood fill the region, clearing pixels as they are counted
+        int n = 0, area = 0;
+        long sumx = 0, sumy = 0;
+        bool edge = false;
+        stack[n++] = start;
+        dark[start] = 0;
+
+        while(n) {
+            int z = stack[--n];
+            int r = z / w, c = z % w;
+            area++;
+            sumx += c;
+            sumy += r;
+            if(r == 0 || c == 0 || r == h-1 || c == w-1) edge = true;
+
+            if(c > 0   && dark[z-1]) {dark[z-1] = 0; stack[n++] = z-1;}
+            if(c < w-1 && dark[z+1]) {dark[z+1] = 0; stack[n++] = z+1;}
+            if(r > 0   && dark[z-w]) {dark[z-w] = 0; stack[n++] = z-w;}
+            if(r < h-1 && dark[z+w]) {dark[z+w] = 0; stack[n++] = z+w;}
+        }
+
+        if(edge || area < minArea || area > maxArea || area <= bestArea)
+            continue;
+
+        bestArea = area;
+        *cx = x0 + (double)sumx/area;
+        *cy = y0 + (double)sumy/area;
+    }
+
+    return bestArea > 0;
+}
+
+bool GridAligner::solve(const double *x, const double *y) {
+
+    //Find the projective mapping that takes the ideal center (u,v) of each
+    //black fiducial cell to the measured center (x,y):
+    //
+    //    x = (h0 u + h1 v + h2) / (h6 u + h7 v + 1)
+    //    y = (h3 u + h4 v + h5) / (h6 u + h7 v + 1)
+    //
+    //Four points give eight linear equations in the eight unknowns.
+    double a[8][9];
+    for(int k=0;k<4;k++) {
+        double u = fidCol[k]*cellsize + cellsize/2.0;
+        double v = fidRow[k]*cellsize + cellsize/2.0;
+        double *r1 = a[2*k], *r2 = a[2*k+1];
+
+        r1[0] = u;  r1[1] = v;  r1[2] = 1;
+        r1[3] = 0;  r1[4] = 0;  r1[5] = 0;
+        r1[6] = -u*x[k];  r1[7] = -v*x[k];  r1[8] = x[k];
+
+        r2[0] = 0;  r2[1] = 0;  r2[2] = 0;
+        r2[3] = u;  r2[4] = v;  r2[5] = 1;
+        r2[6] = -u*y[k];  r2[7] = -v*y[k];  r2[8] = y[k];
+    }
+
+    //Gaussian elimination with partial pivoting
+    for(int col=0;col<8;col++) {
+        int pivot = col;
+        for(int r=col+1;r<8;r++)
+            if(fabs(a[r][col]) > fabs(a[pivot][col])) pivot = r;
+        if(fabs(a[pivot][col]) < 1e-9) return false;   //degenerate
+        if(pivot != col)
+            for(int c=0;c<9;c++) {
+                double t = a[col][c]; a[col][c] = a[pivot][c]; a[pivot][c] = t;
+            }
+
+        for(int r=0;r<8;r++) {
+            if(r == col) continue;
+            double f = a[r][col] / a[col][col];
+            for(int c=col;c<9;c++) a[r][c] -= f * a[col][c];
+        }
+    }
+
+    for(int i=0;i<8;i++) h[i] = a[i][8] / a[i][i];
+    return true;
+}
+
+bool GridAligner::mapSamples() {
+
+    //Map the center of every data cell through the homography.  Cells are
+    //listed in the same order the encoder fills them.
+    int cnt = 0;
+    for(int r=0;r<nrows;r++) {
+        for(int c=0;c<ncols;c++) {
+            if(isFiducialCell(r,c)) continue;
+
+            double u = c*cellsize + cellsize/2.0;
+            double v = r*cellsize + cellsize/2.0;
+            double w = h[6]*u + h[7]*v + 1;
+            if(w <= 0) return false;
+
+            int x = (int)((h[0]*u + h[1]*v + h[2]) / w + 0.5);
+            int y = (int)((h[3]*u + h[4]*v + h[5]) / w + 0.5);
+            if(x < 0 || x >= width || y < 0 || y >= height) return false;
+
+            samples[cnt++] = y*width + x;
+        }
+    }
+    return true;
+}
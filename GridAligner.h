@@ -0,0 +1,37 @@
+//GridAligner.h - locates fiducial cells and maps the cell grid onto a frame
+#ifndef GRIDALIGNER_H
+#define GRIDALIGNER_H
+#include "pxit-parms.h"
+
+/* The encoder (option -f) reserves a 2x2 block of cells in each corner of
+ * the grid.  Three cells of each block are white and the one nearest the
+ * middle of the picture is black.  Black never appears in data, so the
+ * decoder can find the four black cells even when the picture has been
+ * shifted, cropped or rescaled on its way through the broadcast chain.
+ * Their centers determine a projective mapping from ideal cell coordinates
+ * to captured pixel coordinates, and the sample points are taken from that.
+ */
+class GridAligner {
+public:
+    GridAligner();
+
+    bool locate(const int *frame);          //true if all four fiducials were found
+    const int *getSampleOffsets();          //pixel offsets of the data cells, in packet order
+    void reset();                           //forget the tracked positions
+
+    static bool isFiducialCell(int row, int col);
+    static int  fiducialColor(int row, int col);
+
+private:
+    bool   tracking;                        //true once a frame has been aligned
+    double fx[4], fy[4];                    //tracked fiducial centers (pixels)
+    double h[8];                            //homography, h[8] == 1 implied
+    int    samples[ncells];                 //pixel offsets of sample points
+
+    bool findBlob(const int *frame, int x0, int y0, int x1, int y1,
+                  double *cx, double *cy);
+    bool solve(const double *x, const double *y);
+    bool mapSamples();
+};
+
+#endif // GRIDALIGNER_H
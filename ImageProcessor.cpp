@@ -21,20 +21,142 @@ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
 (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
 SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.*/
 
-#include <stdlib.h> //for exit()
+#include <stdlib.h>
+#include <unistd.h> //for unlink()
+#include <fcntl.h>
+#include "Encoder.h"
 #include "ImageProcessor.h"
-#include "TargaImage.h"
 
-void showSamplePoints(int *frame);
-ImageProcessor::ImageProcessor() {  //Convert stream of images into a file
+ImageProcessor::ImageProcessor(OutputSink *Sink) {  //Convert stream of images into a file
+
+    //Luma and color differences of the luma palette, for classify()
+    for(int k=0;k<4;k++) {
+        int red = (symbolColor[paletteLuma][k] >> 16) & 0xFF;
+        int grn = (symbolColor[paletteLuma][k] >>  8) & 0xFF;
+        int blu = (symbolColor[paletteLuma][k]      ) & 0xFF;
+        lumaY[k]  = (77*red + 150*grn + 29*blu) >> 8;
+        lumaCb[k] = blu - lumaY[k];
+        lumaCr[k] = red - lumaY[k];
+    }
+
+    sink     = Sink;
     checksum = new CheckSum(packetSize);
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&jobReady, NULL);
+    pthread_cond_init(&jobsDone, NULL);
+    aligner  = new GridAligner();
+    for(int i=0;i<maxSessions;i++) {
+        sessions[i].store        = NULL;
+        sessions[i].changed      = NULL;
+        sessions[i].manifestSeen = NULL;
+    }
+
+    //Without fiducials we sample the center of every cell of a fixed grid.
+    int cnt = 0;
+    for(int r=0;r<nrows;r++)
+        for(int c=0;c<ncols;c++)
+            gridOffsets[cnt++] = width*(r*cellsize + cellsize/2) + c*cellsize + cellsize/2;
+
+    //The presence detector samples every fourth row and sixth column,
+    //clear of the fiducials in the corners
+    cnt = 0;
+    for(int r=1;r<nrows;r+=4)
+        for(int c=3;c<ncols;c+=6)
+            presenceOffsets[cnt++] = gridOffsets[r*ncols + c];
+
+    //and compares them with every color either palette uses
+    for(int p=0;p<nPalettes;p++)
+        for(int k=0;k<4;k++) {
+            bool seen = false;
+            for(int i=0;i<nPresenceColors;i++)
+                if(presenceColors[i] == symbolColor[p][k]) seen = true;
+            if(!seen) presenceColors[nPresenceColors++] = symbolColor[p][k];
+        }
 }
 
-ImageProcessor::~ImageProcessor() {delete checksum;}
+ImageProcessor::~ImageProcessor() {
+
+    //The worker finishes the jobs it was given first
+    if(workerStarted) {
+        pthread_mutex_lock(&lock);
+        stopping = true;
+        pthread_cond_signal(&jobReady);
+        pthread_mutex_unlock(&lock);
+        pthread_join(worker, NULL);
+    }
+
+    delete checksum;
+    delete aligner;
+    for(int i=0;i<maxSessions;i++) {
+        delete sessions[i].store;
+        delete [] sessions[i].changed;
+        delete [] sessions[i].manifestSeen;
+    }
+    for(int i=0;i<nBases;i++) free(baseNames[i]);
+    for(int i=0;i<nReceived;i++) free(received[i].fname);
+    free(received);
+    pthread_cond_destroy(&jobReady);
+    pthread_cond_destroy(&jobsDone);
+    pthread_mutex_destroy(&lock);
+}
+
+bool ImageProcessor::addBase(const char *fname) {
+    if(nBases == maxBases) {
+        printf("Too many previous versions, %s ignored\n", fname);
+        return false;
+    }
+
+    //A delta names its base by transfer id, the 32-bit FNV-1a hash of the
+    //whole file
+    FILE *fp = fopen(fname, "rb");
+    if(!fp) {
+        perror(fname);
+        return false;
+    }
+    unsigned int h = Encoder::hashFile(fp);
+    fclose(fp);
+
+    //Keep the full path, the caller may change directory
+    char *path = realpath(fname, NULL);
+    if(!path) {
+        perror(fname);
+        return false;
+    }
+    baseNames[nBases] = path;
+    baseIds[nBases++] = h;
+    return true;
+}
+
+bool ImageProcessor::detect(const int *frame) {
+    if(presence <= 0) return true;
+
+    int matches = 0;
+    unsigned int used = 0;          //one bit per palette color seen
+    for(int i=0;i<presenceSamples;i++) {
+        int pixel = frame[presenceOffsets[i]];
+        int red = (pixel >> 16) & 0xFF;
+        int grn = (pixel >>  8) & 0xFF;
+        int blu = (pixel      ) & 0xFF;
+        for(int k=0;k<nPresenceColors;k++) {
+            int dr = red - (int)((presenceColors[k] >> 16) & 0xFF);
+            int dg = grn - (int)((presenceColors[k] >>  8) & 0xFF);
+            int db = blu - (int)((presenceColors[k]      ) & 0xFF);
+            if(dr*dr + dg*dg + db*db < presenceRadius*presenceRadius) {
+                matches++;
+                used |= 1 << k;
+                break;
+            }
+        }
+    }
 
-void ImageProcessor::getDataPacket(char *pixelstream, unsigned char* packet) {
+    //A flat or two-tone picture isn't data, however well it matches
+    int colors = __builtin_popcount(used);
+    return colors >= 3 && matches >= presence*presenceSamples;
+}
+
+void ImageProcessor::getDataPacket(char *pixelstream, unsigned char* packet, int pktLen) {
 	int cellIndex = 0;
-	for (int byteIndex = 0; byteIndex < packetSize; byteIndex++) {
+	for (int byteIndex = 0; byteIndex < pktLen; byteIndex++) {
 		cellIndex = byteIndex * 4;
 		int byte = 0;
 		byte  = pixelstream[cellIndex];
@@ -51,41 +173,59 @@ void ImageProcessor::getDataPacket(char *pixelstream, unsigned char* packet) {
 
 void ImageProcessor::getPixelstream(int *frame, char *pixelstream) {
     
-    //getPixelstream() examines a frame and samples 45x30 pixel values.  'offset' defaults to 0.
-    //If 'offset' is -1 then the software samples pixels one row above the default value.
-    //This allows us to separate distinct images represented by different interlaces.  In other
-    //words each captured frame has complete information from two source frames.
-    
-    int nrows = height/cellsize;
-    int ncols = width /cellsize;
-    int cnt = 0;
-    for(int r=0;r<nrows;r++) {
-        for(int c=0;c<ncols;c++) {
-            
-            //sample the top-left corner of cell
-            //NO take the centers
-            int x = c * cellsize;
-            int y = r * cellsize;
-            
-            x += cellsize/2;
-            y += cellsize/2;
+    //getPixelstream() examines a frame and samples 45x30 pixel values at the
+    //centers of the cells of a fixed grid.
+    classify(frame, gridOffsets, ncells, pixelstream, paletteStandard);
+}
+
+int ImageProcessor::getSymbols(const int *frame, char *pixelstream, int palette) {
+
+    //getSymbols() classifies the cells of a frame the way processImage()
+    //does, on the grid found by the aligner if the frame has fiducials.
+    //Returns the number of symbols.
+    if(aligner->locate(frame)) {
+        classify(frame, aligner->getSampleOffsets(), ncells - fiducialCells, pixelstream, palette);
+        return ncells - fiducialCells;
+    }
+    classify(frame, gridOffsets, ncells, pixelstream, palette);
+    return ncells;
+}
 
+void ImageProcessor::classify(const int *frame, const int *offsets, int n, char *pixelstream,
+                              int palette) {
 
-            int pixelcolor = *(frame + width*y  + x);
+    //Convert the pixel at each sample point into a 2-bit symbol
+    for(int cnt=0;cnt<n;cnt++) {
+        int pixelcolor = *(frame + offsets[cnt]);
             
-            //extract red, green, and blue components
-            int red = (pixelcolor >> 16) & 0xFF;
-            int grn = (pixelcolor >>  8) & 0xFF;
-            int blu = (pixelcolor      ) & 0xFF;
-          
-            //compute colors assuming errors
-            if(red>180 && grn>180 && blu>180) pixelstream[cnt] = 1;
-            else if(red>grn && red>blu)  pixelstream[cnt]=0;
-            else if(grn>red && grn>blu)  pixelstream[cnt]=3;
-            else  pixelstream[cnt]=2;
-           
-            cnt++;            
+        //extract red, green, and blue components
+        int red = (pixelcolor >> 16) & 0xFF;
+        int grn = (pixelcolor >>  8) & 0xFF;
+        int blu = (pixelcolor      ) & 0xFF;
+
+        //the luma palette is read mostly by brightness, with chroma
+        //(BT.601) counting a quarter as much
+        if(palette == paletteLuma) {
+            int luma = (77*red + 150*grn + 29*blu) >> 8;
+            int cb = blu - luma, cr = red - luma;
+            int best = 0, bestDist = 1 << 30;
+            for(int k=0;k<4;k++) {
+                int dy = luma - lumaY[k], db = cb - lumaCb[k], dr = cr - lumaCr[k];
+                int dist = 16*dy*dy + db*db + dr*dr;
+                if(dist < bestDist) {
+                    bestDist = dist;
+                    best = k;
+                }
+            }
+            pixelstream[cnt] = best;
+            continue;
         }
+          
+        //compute colors assuming errors
+        if(red>180 && grn>180 && blu>180) pixelstream[cnt] = 1;
+        else if(red>grn && red>blu)  pixelstream[cnt]=0;
+        else if(grn>red && grn>blu)  pixelstream[cnt]=3;
+        else  pixelstream[cnt]=2;
     }
 }
 
@@ -93,104 +233,853 @@ void ImageProcessor::getPixelstream(int *frame, char *pixelstream) {
 //                          -1 <- bad checksum following valid packet
 //                           1 <- file complete
 
-int ImageProcessor::processImage(int *frame) {
-    //convert frame (bitmap) into a stream of 2-bit symbols
-    getPixelstream(frame,pixelstream);
-    
-    //convert stream of symbols into stream of bytes
-    getDataPacket(pixelstream, packet);
-    
-    //reject packets without valid checksums
-    if(!checksum->verify(packet,packetSize)) {
+int ImageProcessor::processImage(const int *frame) {
+    metrics.count(framesSeen);
+
+    //Most captured video isn't pxit data at all.  A glance at a few cells
+    //is enough to pass over it.  Its time counts as classifying, in one
+    //sample per frame.
+    long long classifyTime = 0, verifyTime = 0;
+    long long t0 = Metrics::now();
+    bool present = detect(frame);
+    long long t1 = Metrics::now();
+    classifyTime += t1 - t0;
+    span("detect", t0, t1);
+    if(!present) {
+        metrics.timeStage(stageClassify, classifyTime);
+        metrics.count(framesIdle);
+        return 0;
+    }
+
+    //Playout shows each frame several times.  Copies of the last good
+    //frame carry nothing new, so they skip the rest of the work.
+    t0 = Metrics::now();
+    bool repeat = isRepeat(frame);
+    t1 = Metrics::now();
+    classifyTime += t1 - t0;
+    span("repeat", t0, t1);
+    if(repeat) {
+        metrics.timeStage(stageClassify, classifyTime);
+        metrics.count(framesRepeated);
+        return 1;
+    }
+
+    //Frames drawn with fiducials are sampled where the aligner finds the
+    //grid.  All others are sampled on the fixed grid.
+    t0 = Metrics::now();
+    bool fid = aligner->locate(frame);
+    int  pktLen = fid ? fidPacketSize : packetSize;
+    t1 = Metrics::now();
+    metrics.timeStage(stageAlign, t1 - t0);
+    span("align", t0, t1);
+    if(fid) metrics.count(framesAligned);
+
+    //convert frame (bitmap) into a stream of 2-bit symbols, then into a
+    //stream of bytes, and reject packets without valid checksums.  The
+    //checksum tag tells us which header the packet carries.  A frame may
+    //be drawn with either palette, so if the one that worked last time
+    //doesn't, try the other.
+    const int *offsets = fid ? aligner->getSampleOffsets() : gridOffsets;
+    int nsamples = fid ? ncells - fiducialCells : ncells;
+    int stored = 0, failed = 0;
+    for(int k=0; k<nPalettes && !stored; k++) {
+        int pal = (palette + k) % nPalettes;
+        classify(frame, offsets, nsamples, pixelstream, pal);
+        if(k == 0) memcpy(softSymbols[softNext], pixelstream, nsamples);
+        long long tc = Metrics::now();
+        span("classify", t1, tc);
+        classifyTime += tc - t1;
+
+        stored = checkSymbols(pktLen, fid, &failed, &classifyTime, &verifyTime);
+        t1 = Metrics::now();
+        if(stored) palette = pal;
+    }
+
+    //A frame that failed, or some bands of which did, may still be
+    //recovered from earlier copies of it, decoded in the palette that
+    //worked last.  Bands that passed aren't checked again.  The vote and
+    //the checks after it count as verifying.
+    int bandLen = fid ? fidBandPacketSize : bandPacketSize;
+    if(failed) {
+        int cur = softNext;
+        softSamples[cur] = nsamples;
+        softNext = (softNext + 1) % softCopies;
+        t0 = Metrics::now();
+        if(combineCopies(cur, nsamples)) {
+            long long packTime = 0, checkTime = 0;
+            int n = stored ? checkPackets(bandLen, fid, &failed, &packTime, &checkTime) :
+                             checkSymbols(pktLen, fid, &failed, &packTime, &checkTime);
+            metrics.count(packetsCombined, n);
+            stored += n;
+        }
+        t1 = Metrics::now();
+        verifyTime += t1 - t0;
+        span("combine", t0, t1);
+    }
+    metrics.timeStage(stageClassify, classifyTime);
+    metrics.timeStage(stageVerify, verifyTime);
+    for(int b=0; b<nBands; b++)
+        if(failed & 1 << b) metrics.count(checksumFail);
+    if(!stored) {
         if(gotFirstFrame) return -1;
         else return 0;
     }
-    
-    //compare file length in header with previous value
-	filelength = packet[0];
-	filelength <<= 8;
-	filelength |= packet[1];
-	filelength <<= 8;
-	filelength |= packet[2];
-    
-    int sequence;
-	sequence = packet[3];
-	sequence <<= 8;
-	sequence |= packet[4];
+    gotFirstFrame = true;
 
-    
-    //Did the file length change?
-	if(filelength != previous && previous != 0) 
-        resetDecoder();     //yes. prepare to decode a new file
-    else if(fileComplete)   
-        return 0;           //no. ignore this packet.
+    //Failed frames kept so far were copies of some other packet, or of
+    //this one, which is now all in.  Its copies can be passed over.
+    if(!failed) {
+        for(int i=0; i<softCopies; i++) softSamples[i] = 0;
+        rememberFrame(offsets, nsamples);
+    }
+    return 1;
+}
 
-    //Is this the first packet we've seen from the file?
-    if(!gotFirstFrame) {
-        gotFirstFrame = true;
-
-		//Compute number of data blocks (packets) needed and the size of the last one.
-		blocksNeeded = filelength / blockSize;
-		lastBlockSize = filelength - blocksNeeded*blockSize;
-		if (lastBlockSize) blocksNeeded++;  //last block is partially filled	
-        
-        //create an output file. use time to create filename
-        time_t     now;
-        struct tm  ts;
-
-        // Get current time
-        time(&now);
-
-        // Format time, "ddd yyyy-mm-dd hh:mm:ss zzz"
-        ts = *localtime(&now);
-        strftime(outputfname, sizeof(outputfname), "%Y-%m-%d_%H:%M:%S_%Z.7z", &ts);
-
-        outputFile = fopen(outputfname, "wb");  //note .7z extension.
-        if(outputFile == NULL) perror("fopen");
-		BlockFlags = new bool[blocksNeeded];	//bool array for each block we'll need
-        
-		for (int i = 0; i < blocksNeeded; i++)
-			BlockFlags[i] = false;			    //no blocks have been processed yet
+//checkSymbols() checks the packet in pixelstream, or failing that the
+//packets in its bands, and stores those that pass.  Returns the number
+//stored.  failed gets a bit for each packet that didn't pass, band b or
+//bit 0 for a whole frame; if none did, the bits of the layout that
+//worked last.
+int ImageProcessor::checkSymbols(int pktLen, bool fid, int *failed,
+                                 long long *packTime, long long *verifyTime) {
+    int bandLen = fid ? fidBandPacketSize : bandPacketSize;
+
+    //Try the layout that worked last time first
+    for(int pass=0; pass<2; pass++) {
+        bool bands = (pass == 0) == bandsFirst;
+        *failed = bands ? (1 << nBands) - 1 : 1;
+        int good = checkPackets(bands ? bandLen : pktLen, fid, failed, packTime, verifyTime);
+        if(good) {
+            bandsFirst = bands;
+            return good;
+        }
     }
-    
+    *failed = bandsFirst ? (1 << nBands) - 1 : 1;
+    return 0;
+}
+
+//checkPackets() checks the packets of length len in pixelstream that have
+//their bit set in failed, clears the bits of those that pass and stores
+//them.  Returns the number stored.
+int ImageProcessor::checkPackets(int len, bool fid, int *failed,
+                                 long long *packTime, long long *verifyTime) {
+    int bandLen = fid ? fidBandPacketSize : bandPacketSize;
+    int good = 0;
+    for(int b=0; b<nBands; b++) {
+        if(!(*failed & 1 << b)) continue;
+        long long t0 = Metrics::now();
+        getDataPacket(pixelstream + b*len*4, packet, len);
+        long long t1 = Metrics::now();
+        int tag = checksum->identify(packet, len);
+        long long t2 = Metrics::now();
+        span("pack", t0, t1);
+        span("verify", t1, t2);
+        *packTime   += t1 - t0;
+        *verifyTime += t2 - t1;
+        if(tag < 0) continue;
+
+        //Bands with the original header add up to a packet that also
+        //passes, so such a frame is only whole if its first band isn't
+        if(len != bandLen && tag == tagNone) {
+            unsigned char first[packetSize];
+            getDataPacket(pixelstream, first, bandLen);
+            if(checksum->identify(first, bandLen) >= 0) break;
+        }
 
-    //have we seen this sequence number before?
-    if (!BlockFlags[sequence]) {
-        
-        //No, this is a new one. Update records
-        BlockFlags[sequence] = true;	//We just got a new block
-        nBlocksFound++;
+        //With several inputs, the shared processor keeps the files
+        metrics.count(checksumPass);
+        if(combiner) {
+            combiner->storePacket(tag, packet, len, fid);
+            span("store", t2, Metrics::now());
+        } else
+            storePacket(tag, packet, len, fid);
+        *failed &= ~(1 << b);
+        good++;
+    }
+    return good;
+}
 
-        //Seek to location based on sequence number found.
-        fseek(outputFile, sequence*blockSize, SEEK_SET);
+//storePacket() takes a packet whose checksum has been checked, and the tag
+//it was checked with.  It may be called from several threads.
+int ImageProcessor::storePacket(int tag, const unsigned char *pkt, int pktLen, bool fid) {
+    pthread_mutex_lock(&lock);
+    if(pkt != packet) memcpy(packet, pkt, pktLen);
+    int rtn = acceptPacket(tag, pktLen, fid);
+    pthread_mutex_unlock(&lock);
+    return rtn;
+}
 
-        //Compute number of bytes to copy
-        int bytesToCopy = blockSize;
-        if (sequence + 1 == blocksNeeded) 
-            bytesToCopy = lastBlockSize;
+//processPacket() takes a packet that was received earlier, such as one
+//saved in a journal, and checks and stores it as processImage() would.
+int ImageProcessor::processPacket(const unsigned char *pkt, int pktLen) {
+    if(pktLen != packetSize && pktLen != fidPacketSize &&
+       pktLen != bandPacketSize && pktLen != fidBandPacketSize) return 0;
 
-        //Copy user data to the file
-        fwrite((char *)&packet[headerSize], 1, bytesToCopy, outputFile);
+    int tag = checksum->identify(pkt, pktLen);
+    if(tag < 0) {
+        metrics.count(checksumFail);
+        return 0;
     }
+    metrics.count(checksumPass);
+    return storePacket(tag, pkt, pktLen, pktLen == fidPacketSize || pktLen == fidBandPacketSize);
+}
 
-    //Have we gotten the entire file?
-    if (nBlocksFound == blocksNeeded) {
-        fclose(outputFile);
-        fileComplete = true;
-        filelength = 0; //so we can receive another file, possibly the same one
-        printf("File Transfer Complete: %s\n",outputfname);
+int ImageProcessor::acceptPacket(int tag, int pktLen, bool fid) {
+
+    //read file length, sequence number and (if present) transfer id.
+    //Band packets are shorter, so they have their own sessions.
+    long long filelength, id = -1;
+    int sequence, hdrLen;
+    unsigned long long key;
+    int layout = fid | (pktLen == bandPacketSize || pktLen == fidBandPacketSize ? 16 : 0);
+
+    if(tag == tagExtended || tag == tagIntegrity || tag == tagDelta) {
+        hdrLen = tag == tagDelta ? deltaHeaderSize :
+                 tag == tagIntegrity ? integHeaderSize : extHeaderSize;
+        id = ((unsigned)packet[0] << 24) | (packet[1] << 16) | (packet[2] << 8) | packet[3];
+        filelength = ((unsigned)packet[4] << 24) | (packet[5] << 16) | (packet[6] << 8) | packet[7];
+        sequence = (packet[8] << 16) | (packet[9] << 8) | packet[10];
+        key = (((tag == tagDelta ? 8ULL : 0) | (tag == tagIntegrity ? 4ULL : 0) |
+                2ULL | layout) << 32) | id;
+    } else {
+        hdrLen = headerSize;
+        filelength = (packet[0] << 16) | (packet[1] << 8) | packet[2];
+        sequence = (packet[3] << 8) | packet[4];
+        key = ((unsigned long long)layout << 32) | filelength;
+    }
+
+    //Drop packets of a file we already have
+    if(!sink && !receivedLoaded) loadReceived();
+    if(id >= 0 && nReceived) {
+        unsigned long long content = ((unsigned long long)id << 32) | filelength;
+        int i = findReceived(content);
+        time_t now = time(NULL);
+        if(i < nReceived && received[i].content == content &&
+           now - received[i].checked >= stateInterval) {
+            received[i].checked = now;
+            if(access(received[i].fname, F_OK) != 0) {
+                free(received[i].fname);
+                nReceived--;
+                memmove(&received[i], &received[i+1], (nReceived - i) * sizeof(Received));
+                Session *old = findSession(key);
+                if(old && old->complete) endSession(old);
+            }
+        }
+        if(i < nReceived && received[i].content == content) {
+            metrics.count(blocksKnown);
+            return 0;
+        }
     }
     
+    //Is this the first packet we've seen from the file?
+    //A file whose output couldn't be created is tried again now and then
+    Session *s = findSession(key);
+    if(!s) {
+        if(key == unwritableKey && time(NULL) - unwritableTime < stateInterval) return 0;
+        s = newSession(key, id, filelength, pktLen - hdrLen - csumSize);
+        if(!s) {
+            unwritableKey  = key;
+            unwritableTime = time(NULL);
+            return 0;
+        }
+        s->hashed   = tag == tagIntegrity || tag == tagDelta;
+        s->fileHash = 0;
+        for(int i=0; s->hashed && i<8; i++) s->fileHash = (s->fileHash << 8) | packet[extHeaderSize+i];
+
+        s->baseId = -1;
+        s->manifestParts = s->manifestFound = 0;
+        s->baseCopied = false;
+        if(tag == tagDelta) {
+            s->baseId = ((unsigned)packet[19] << 24) | (packet[20] << 16) |
+                        (packet[21] << 8) | packet[22];
+            int n = s->store->getBlocksNeeded();
+            s->changed = new bool[n];
+            memset(s->changed, 0, n);
+        }
+    }
+    s->lastUsed = ++clock;
+    if(s->complete) {           //ignore the rest of a finished file
+        metrics.count(blocksDuplicate);
+        return 0;
+    }
+
+    //A delta's manifest says which blocks to expect.  Once we have all
+    //of it, the rest come from the previous version.
+    if(s->changed && sequence >= manifestBase) {
+        bool isNew = acceptManifest(s, sequence - manifestBase, &packet[hdrLen],
+                                    pktLen - hdrLen - csumSize);
+        if(isNew && journal) journal->append(packet, pktLen);
+        if(!isNew) metrics.count(blocksDuplicate);
+        if(s->manifestParts && s->manifestFound == s->manifestParts && !s->baseCopied) {
+            long long t0 = Metrics::now();
+            copyFromBase(s);
+            span("base", t0, Metrics::now());
+        }
+        checkComplete(s);
+        return 1;
+    }
+
+    //Copy user data to the file if this is a new block
+    long long t3 = Metrics::now();
+    int isNew = s->store->putBlock(sequence, &packet[hdrLen]);
+    if(isNew > 0 && journal) journal->append(packet, pktLen);
+    if(isNew > 0 && sink)
+        sink->block(s->info, sequence, (long long)sequence*s->info.blockSize,
+                    &packet[hdrLen], s->store->blockLength(sequence));
+    long long t4 = Metrics::now();
+    metrics.timeStage(stageWrite, t4 - t3);
+    span("write", t3, t4);
+    if(isNew >= 0) metrics.count(isNew ? blocksNew : blocksDuplicate);
+
+    checkComplete(s);
     return 1;
 }
 
-void ImageProcessor::resetDecoder() {
-    gotFirstFrame = false;
-    nBlocksFound = 0;
-    previous = filelength;
-    fileComplete = false;
+bool ImageProcessor::acceptManifest(Session *s, int part, const unsigned char *data,
+                                    int len) {
+
+    //parts and ranges, then first and count of each range, Big Endian
+    int parts  = (data[0] << 8) | data[1];
+    int nranges = (data[2] << 8) | data[3];
+    if(parts == 0 || part >= parts || 4 + 6*nranges > len) return false;
+    if(s->manifestParts && parts != s->manifestParts) return false;
+    if(!s->manifestSeen) {
+        s->manifestParts = parts;
+        s->manifestSeen  = new bool[parts];
+        memset(s->manifestSeen, 0, parts);
+    }
+    if(s->manifestSeen[part]) return false;
+    s->manifestSeen[part] = true;
+    s->manifestFound++;
+
+    int n = s->store->getBlocksNeeded();
+    for(int i=0; i<nranges; i++) {
+        const unsigned char *r = data + 4 + 6*i;
+        int first = (r[0] << 16) | (r[1] << 8) | r[2];
+        int count = (r[3] << 16) | (r[4] << 8) | r[5];
+        for(int seq=first; seq<first+count && seq<n; seq++) s->changed[seq] = true;
+    }
+    return true;
 }
 
+void ImageProcessor::copyFromBase(Session *s) {
+    s->baseCopied = true;
 
+    //The previous version was given to us, or received earlier
+    const char *baseName = NULL;
+    for(int b=0; b<nBases && !baseName; b++)
+        if(baseIds[b] == s->baseId) baseName = baseNames[b];
+    int r = findReceived((unsigned long long)s->baseId << 32);
+    if(!baseName && r < nReceived && (received[r].content >> 32) == (unsigned long long)s->baseId)
+        baseName = received[r].fname;
+    if(!baseName) {
+        printf("Delta %08llx applies to version %08llx, which we don't have\n",
+               s->key & 0xFFFFFFFF, s->baseId);
+        return;
+    }
+
+    //Every block the manifest doesn't list is the same as in the previous
+    //version, at the same offset.  The worker copies them.
+    Job *job = new Job;
+    job->kind    = jobCopy;
+    job->session = s;
+    job->serial  = s->serial;
+    job->base    = strdup(baseName);
+    job->baseId  = s->baseId;
+    job->blocks  = s->store->getBlocksNeeded();
+    job->blkSize = s->store->getBlockSize();
+    job->length  = s->store->getLength();
+    job->skip    = new bool[job->blocks];
+    memcpy(job->skip, s->changed, job->blocks);
+    strcpy(job->fname, s->outputfname);
+    submit(job);
+}
+
+//copyRange() copies len bytes at off from one file to the same place in
+//another, within the kernel where the filesystem allows.  buf holds the
+//same bytes, for filesystems that don't.
+static bool copyRange(int in, int out, off_t off, long long len, const unsigned char *buf) {
+    loff_t inOff = off, outOff = off;
+    while(len > 0) {
+        ssize_t n = copy_file_range(in, &inOff, out, &outOff, len, 0);
+        if(n <= 0) break;
+        len -= n;
+    }
+    return len == 0 || pwrite(out, buf + (outOff - off), len, outOff) == len;
+}
 
+//finishCopy() runs on the worker.  It reads and copies an extent of
+//unchanged blocks at a time without the lock, since the previous version
+//may be gigabytes, and takes the lock only to record them.
+void ImageProcessor::finishCopy(Job *job) {
+    int perExtent = baseExtent / job->blkSize;
+    unsigned char *buf = new unsigned char[(long long)perExtent*job->blkSize];
+    unsigned long long *hashes = new unsigned long long[perExtent];
 
+    //With a sink there is no output file
+    int in  = open(job->base, O_RDONLY);
+    int out = job->fname[0] ? open(job->fname, O_WRONLY) : -1;
+    bool ok = in >= 0 && (out >= 0 || !job->fname[0]);
+    if(in < 0) perror(job->base);
+    else if(!ok) perror(job->fname);
+
+    //Find the last block to copy, then each run of them
+    int lastBlock = job->blocks - 1;
+    while(lastBlock >= 0 && job->skip[lastBlock]) lastBlock--;
+    for(int start=0; start<=lastBlock && ok; start++) {
+        if(job->skip[start]) continue;
+        int end = start;
+        while(end < job->blocks && !job->skip[end]) end++;
+        for(int first=start; first<end && ok; first+=perExtent) {
+            int count = end - first < perExtent ? end - first : perExtent;
+            off_t off = (off_t)first*job->blkSize;
+            long long len = (long long)count*job->blkSize;
+            if(len > job->length - off) len = job->length - off;
+            long long t0 = Metrics::now();
+            if(pread(in, buf, len, off) != len) {
+                printf("%s is too short to be version %08llx\n", job->base, job->baseId);
+                ok = false;
+                break;
+            }
+            if(out >= 0 && !copyRange(in, out, off, len, buf)) {
+                perror(job->fname);
+                ok = false;
+                break;
+            }
+            for(int i=0; i<count; i++) {
+                long long at = (long long)i*job->blkSize;
+                int blkLen = len - at < job->blkSize ? len - at : job->blkSize;
+                hashes[i] = CheckSum::blockHash(first + i, buf + at, blkLen);
+            }
+
+            //Start writing the extent back, and make sure of the whole copy
+            //before the last blocks count, so finishing the file is quick
+            bool last = first + count > lastBlock;
+            if(out >= 0 && !last) sync_file_range(out, off, len, SYNC_FILE_RANGE_WRITE);
+            if(out >= 0 && last && fdatasync(out) < 0) {
+                perror(job->fname);
+                ok = false;
+                break;
+            }
+
+            //The file may have been given up meanwhile
+            pthread_mutex_lock(&lock);
+            Session *s = job->session;
+            ok = s->store && s->serial == job->serial;
+            int copied = 0;
+            for(int i=0; ok && i<count; i++) {
+                int seq = first + i;
+                if(!s->store->markBlock(seq, hashes[i])) continue;
+                long long at = (long long)i*job->blkSize;
+                if(sink) sink->block(s->info, seq, off + at, buf + at, s->store->blockLength(seq));
+                copied++;
+            }
+            metrics.count(blocksFromBase, copied);
+            span("base", t0, Metrics::now());
+            if(ok) checkComplete(s);
+            pthread_mutex_unlock(&lock);
+        }
+        start = end;
+    }
+
+    if(in >= 0)  close(in);
+    if(out >= 0) close(out);
+    delete [] buf;
+    delete [] hashes;
+    delete [] job->skip;
+    free(job->base);
+}
+
+void ImageProcessor::checkComplete(Session *s) {
+
+    //Have we gotten the entire file?
+    //A file sent with its hash is only complete if it matches
+    long long t0 = Metrics::now();
+    if (s->store->isComplete() && sink) {
+        s->complete = true;
+        s->info.verified = !s->hashed ? 0 : s->store->contentHash() == s->fileHash ? 1 : -1;
+        metrics.count(s->info.verified < 0 ? filesCorrupt : filesComplete);
+        sink->complete(s->info);
+        span("finish", t0, Metrics::now());
+
+    } else if (s->store->isComplete()) {
+        bool written = s->store->finish();
+        s->complete = true;
+        bool good = written && (!s->hashed || s->store->contentHash() == s->fileHash);
+        metrics.count(good ? filesComplete : filesCorrupt);
+
+        //an earlier missing-block report and the saved state are out of
+        //date now
+        char fname[220];
+        sprintf(fname, "%s.missing", s->outputfname);
+        unlink(fname);
+        stateName(s, fname);
+        unlink(fname);
+
+        //List the file so that later copies of it can be passed over
+        long long id = s->store->getTransferId();
+        if(good && id >= 0) {
+            unsigned long long content = ((unsigned long long)id << 32) | s->store->getLength();
+            addReceived(content, s->outputfname);
+            FILE *fp = fopen(receivedName, "a");
+            if(fp) {
+                fprintf(fp, "%016llx %s\n", content, s->outputfname);
+                fclose(fp);
+            } else
+                perror(receivedName);
+        }
+
+        if(!written)
+            printf("File Transfer Failed: %s could not be written\n", s->outputfname);
+        else if(!good)
+            printf("File Transfer Failed: %s does not match the file that was sent\n",
+                   s->outputfname);
+        else if(s->hashed)
+            printf("File Transfer Complete: %s (verified)\n",s->outputfname);
+        else
+            printf("File Transfer Complete: %s\n",s->outputfname);
+        span("finish", t0, Metrics::now());
+
+    //Every few seconds, save enough state to resume after a restart
+    } else if (!sink && s->store->getUnsaved() && time(NULL) - s->lastSaved >= stateInterval) {
+        saveLater(s);
+        span("save", t0, Metrics::now());
+    }
+}
+
+void ImageProcessor::rememberFrame(const int *offsets, int nsamples) {
+
+    //Keep the sample points and symbols of the cells isRepeat() looks at
+    int n = 0;
+    for(int i=0; i<nsamples; i++) {
+        if(i >= repeatHeaderCells && (i - repeatHeaderCells) % repeatStride) continue;
+        repeatOffsets[n] = offsets[i];
+        repeatSymbols[n] = pixelstream[i];
+        n++;
+    }
+    repeatCells = n;
+}
+
+bool ImageProcessor::combineCopies(int cur, int nsamples) {
+
+    //Find the failed frames that look like copies of this one
+    int copies[softCopies], n = 0;
+    copies[n++] = cur;
+    for(int j=0; j<softCopies; j++) {
+        if(j == cur || softSamples[j] != nsamples) continue;
+        int differ = 0;
+        for(int i=0; i<nsamples && differ <= softMaxDiffer; i++)
+            if(softSymbols[j][i] != softSymbols[cur][i]) differ++;
+        if(differ <= softMaxDiffer) copies[n++] = j;
+    }
+    if(n < softMinCopies) return false;
+
+    //Vote on each cell, leaving the result for the caller to check
+    for(int i=0; i<nsamples; i++) {
+        int votes[4] = {0, 0, 0, 0};
+        for(int c=0; c<n; c++) votes[(int)softSymbols[copies[c]][i]]++;
+        int best = softSymbols[cur][i];
+        for(int v=0; v<4; v++)
+            if(votes[v] > votes[best]) best = v;
+        pixelstream[i] = best;
+    }
+    return true;
+}
+
+bool ImageProcessor::isRepeat(const int *frame) {
+    if(!repeatCells) return false;
+
+    char symbols[maxRepeatCells];
+    classify(frame, repeatOffsets, repeatCells, symbols, palette);
+
+    //The header has to match exactly, the data only nearly
+    int differ = 0;
+    for(int i=0; i<repeatCells; i++) {
+        if(symbols[i] == repeatSymbols[i]) continue;
+        if(i < repeatHeaderCells || ++differ > repeatTolerance) return false;
+    }
+    return true;
+}
+
+Session *ImageProcessor::findSession(unsigned long long key) {
+    for(int i=0;i<maxSessions;i++)
+        if(sessions[i].store && sessions[i].key == key) return &sessions[i];
+    return NULL;
+}
+
+Session *ImageProcessor::newSession(unsigned long long key, long long id,
+                                    long long length, int blkLen) {
+
+    //Use a free slot, or else give up the one used least recently
+    Session *s = NULL;
+    for(int i=0;i<maxSessions && !s;i++)
+        if(!sessions[i].store) s = &sessions[i];
+
+    if(!s) {
+        s = &sessions[0];
+        for(int i=1;i<maxSessions;i++)
+            if(sessions[i].lastUsed < s->lastUsed) s = &sessions[i];
+        endSession(s);
+    }
+
+    s->key       = key;
+    s->complete  = false;
+    s->serial    = ++sessionCount;
+    s->lastSaved = time(NULL);
+    s->saves     = 0;
+    s->store     = new ReassemblyStore();
+
+    //A sink only needs to be told about the file
+    if(sink) {
+        s->store->create(NULL, length, blkLen, id);
+        s->outputfname[0]  = 0;
+        s->info.key        = key;
+        s->info.id         = id;
+        s->info.length     = length;
+        s->info.blockSize  = blkLen;
+        s->info.blocks     = s->store->getBlocksNeeded();
+        s->info.verified   = 0;
+        sink->begin(s->info);
+        return s;
+    }
+
+    //Pick up where an earlier run left off if it saved its state
+    char fname[220];
+    stateName(s, fname);
+    if(s->store->resume(fname, key)) {
+        strcpy(s->outputfname, s->store->getFilename());
+        printf("Resuming %s: %d of %d blocks received\n", s->outputfname,
+               s->store->getBlocksFound(), s->store->getBlocksNeeded());
+        return s;
+    }
+
+    //create an output file. use time to create filename
+    time_t     now;
+    struct tm  ts;
+
+    // Get current time
+    time(&now);
+
+    // Format time, "ddd yyyy-mm-dd hh:mm:ss zzz"
+    ts = *localtime(&now);
+    char stamp[100];
+    strftime(stamp, sizeof(stamp), "%Y-%m-%d_%H:%M:%S_%Z", &ts);
+
+    //Several files can start in the same second
+    sprintf(s->outputfname, "%s.7z", stamp);  //note .7z extension.
+    for(int n=2; access(s->outputfname, F_OK) == 0; n++)
+        sprintf(s->outputfname, "%s-%d.7z", stamp, n);
+
+    //The store preallocates the file and keeps track of the blocks
+    //we've received.  Without a file there is nothing to receive into.
+    if(!s->store->create(s->outputfname, length, blkLen, id)) {
+        delete s->store;
+        s->store = NULL;
+        return NULL;
+    }
+    return s;
+}
+
+void ImageProcessor::endSession(Session *s) {
+    reportMissing(s);       //note what an unfinished file still lacks
+    saveState(s);           //so it can be picked up again later
+    delete s->store;
+    s->store = NULL;
+    delete [] s->changed;
+    delete [] s->manifestSeen;
+    s->changed      = NULL;
+    s->manifestSeen = NULL;
+}
+
+//Save the blocks still missing from each unfinished file next to its partial
+//output.  pxit-encoder -m reads the report and re-sends only those frames.
+//Blocks the worker is still copying would be reported, so wait for it.
+void ImageProcessor::reportMissing() {
+    pthread_mutex_lock(&lock);
+    drain();
+    for(int i=0;i<maxSessions;i++)
+        if(sessions[i].store) reportMissing(&sessions[i]);
+    pthread_mutex_unlock(&lock);
+}
+
+void ImageProcessor::reportMissing(Session *s) {
+    if(s->complete || sink) return;
+
+    char fname[220];
+    sprintf(fname, "%s.missing", s->outputfname);
+    int n = s->store->writeMissing(fname);
+    if(n >= 0)
+        printf("Missing %d of %d blocks. Report written to %s\n",
+               n, s->store->getBlocksNeeded(), fname);
+}
+
+//Save the state of every unfinished file that has received blocks since it
+//was last saved.  Call this before exiting.
+void ImageProcessor::checkpoint() {
+    pthread_mutex_lock(&lock);
+    drain();
+    if(journal) journal->sync();
+    for(int i=0;i<maxSessions;i++)
+        if(sessions[i].store && sessions[i].store->getUnsaved()) saveState(&sessions[i]);
+    pthread_mutex_unlock(&lock);
+}
+
+void ImageProcessor::saveState(Session *s) {
+    if(s->complete || sink) return;
+
+    char fname[220];
+    stateName(s, fname);
+    s->store->saveState(fname, s->key);
+    s->lastSaved = time(NULL);
+    s->saves++;                 //newer than any the worker has
+}
+
+//saveLater() takes the state of a file and leaves writing it to the worker
+void ImageProcessor::saveLater(Session *s) {
+    Job *job = new Job;
+    job->kind    = jobSave;
+    job->session = s;
+    job->serial  = s->serial;
+    job->saveNo  = ++s->saves;
+    job->state   = s->store->takeState(s->key);
+    stateName(s, job->fname);
+    s->lastSaved = time(NULL);
+    submit(job);
+}
+
+//finishSave() runs on the worker, without the lock.  It writes the state
+//under a name of its own, since saveState() may be writing at the same
+//time, and renames it once it has checked, under the lock, that the state
+//is still wanted.
+void ImageProcessor::finishSave(Job *job) {
+    char tmp[230];
+    sprintf(tmp, "%s.new", job->fname);
+    bool ok = ReassemblyStore::writeState(job->state, tmp);
+    delete job->state;
+
+    pthread_mutex_lock(&lock);
+    Session *s = job->session;
+    if(ok && s->store && s->serial == job->serial && !s->complete && s->saves == job->saveNo) {
+        if(rename(tmp, job->fname) < 0) perror("rename");
+    } else
+        unlink(tmp);
+    pthread_mutex_unlock(&lock);
+}
+
+//submit() hands a job to the worker, starting it if need be.  Call it with
+//the lock held.
+void ImageProcessor::submit(Job *job) {
+    if(!workerStarted) {
+        pthread_create(&worker, NULL, runWorker, this);
+        workerStarted = true;
+    }
+    job->next = NULL;
+    *jobsEnd = job;
+    jobsEnd = &job->next;
+    jobsPending++;
+    pthread_cond_signal(&jobReady);
+}
+
+//drain() waits, with the lock held, until the worker has done every job
+void ImageProcessor::drain() {
+    while(jobsPending) pthread_cond_wait(&jobsDone, &lock);
+}
+
+void *ImageProcessor::runWorker(void *processor) {
+    ((ImageProcessor *)processor)->work();
+    return NULL;
+}
+
+void ImageProcessor::work() {
+    pthread_mutex_lock(&lock);
+    if(trace) workerTrace = trace->addThread("worker");
+    for(;;) {
+        while(!jobs && !stopping) pthread_cond_wait(&jobReady, &lock);
+        if(!jobs) break;
+        Job *job = jobs;
+        jobs = job->next;
+        if(!jobs) jobsEnd = &jobs;
+        pthread_mutex_unlock(&lock);
+
+        if(job->kind == jobSave) finishSave(job);
+        if(job->kind == jobCopy) finishCopy(job);
+        delete job;
+
+        pthread_mutex_lock(&lock);
+        if(--jobsPending == 0) pthread_cond_broadcast(&jobsDone);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+//loadReceived() reads the list of files received earlier, once the output
+//directory is the current one.  Files that are gone are left off.
+void ImageProcessor::loadReceived() {
+    receivedLoaded = true;
+    FILE *fp = fopen(receivedName, "r");
+    if(!fp) return;
+
+    unsigned long long content;
+    char fname[200];
+    while(fscanf(fp, "%llx %199s", &content, fname) == 2) {
+        int i = findReceived(content);
+        if(i < nReceived && received[i].content == content) continue;
+        if(access(fname, F_OK) == 0) addReceived(content, fname);
+    }
+    fclose(fp);
+}
+
+//findReceived() returns the index of the first entry at or after content
+int ImageProcessor::findReceived(unsigned long long content) {
+    int lo = 0, hi = nReceived;
+    while(lo < hi) {
+        int mid = (lo + hi)/2;
+        if(received[mid].content < content) lo = mid + 1;
+        else                                hi = mid;
+    }
+    return lo;
+}
+
+void ImageProcessor::addReceived(unsigned long long content, const char *fname) {
+    int i = findReceived(content);
+    if(i < nReceived && received[i].content == content) {
+        free(received[i].fname);
+        received[i].fname = strdup(fname);
+        received[i].checked = time(NULL);
+        return;
+    }
+    if(nReceived == maxReceived) {
+        maxReceived = maxReceived ? 2*maxReceived : 64;
+        received = (Received *)realloc(received, maxReceived * sizeof(Received));
+    }
+    memmove(&received[i+1], &received[i], (nReceived - i) * sizeof(Received));
+    received[i].content = content;
+    received[i].fname   = strdup(fname);
+    received[i].checked = time(NULL);
+    nReceived++;
+}
+
+//State files are named after the session key so the next run can find
+//them when the same file turns up again.
+void ImageProcessor::stateName(Session *s, char *fname) {
+    sprintf(fname, "pxit-%012llx.state", s->key);
+}
+
+//Blocks still needed by the files being received, for progress reports
+long ImageProcessor::blocksRemaining() {
+    long n = 0;
+    pthread_mutex_lock(&lock);
+    for(int i=0;i<maxSessions;i++)
+        if(sessions[i].store && !sessions[i].complete)
+            n += sessions[i].store->getBlocksNeeded() - sessions[i].store->getBlocksFound();
+    pthread_mutex_unlock(&lock);
+    return n;
+}
+
+int ImageProcessor::sessionsActive() {
+    int n = 0;
+    pthread_mutex_lock(&lock);
+    for(int i=0;i<maxSessions;i++)
+        if(sessions[i].store && !sessions[i].complete) n++;
+    pthread_mutex_unlock(&lock);
+    return n;
+}
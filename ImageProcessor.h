@@ -1,39 +1,237 @@
 #ifndef IMAGEPROCESSOR_H
 #define IMAGEPROCESSOR_H
+#include <pthread.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/time.h>
 #include <time.h>
 #include "checksum.h"
+#include "GridAligner.h"
+#include "Metrics.h"
+#include "OutputSink.h"
+#include "PacketJournal.h"
+#include "ReassemblyStore.h"
+#include "Trace.h"
 #include "pxit-parms.h"
 
+//A file being received.  Packets with the extended header are matched to
+//a session by transfer id; packets with the original header by file length.
+//The layout (with or without fiducials) and header are part of the key
+//because they change the block size.
+//
+//A delta names the previous version by its transfer id.  Once all of its
+//manifest has arrived, the blocks that didn't change are copied from that
+//version, if it was given to addBase().  The processor's worker thread
+//copies them, so a large file doesn't hold up decoding.
+struct Session {
+    unsigned long long key;
+    ReassemblyStore   *store;           //NULL when the slot is free
+    bool               complete;
+    bool               hashed;          //sent with the integrity header
+    unsigned long long fileHash;        //that the finished file should have
+    long long          baseId;          //delta: id of the previous version, else -1
+    bool              *changed;         //delta: blocks the manifest lists
+    bool              *manifestSeen;    //delta: parts received, NULL until one is
+    int                manifestParts;
+    int                manifestFound;
+    bool               baseCopied;      //or reported missing
+    long               lastUsed;        //for least-recently-used eviction
+    long               serial;          //tells the sessions a slot has held apart
+    time_t             lastSaved;       //when the state was last saved
+    int                saves;           //states taken; only the last is kept
+    char               outputfname[200];
+    TransferInfo       info;            //for the output sink
+};
+
+//Work for the processor's own thread, done in the order given
+enum JobKind {jobSave, jobCopy};
+struct Job {
+    int                kind;
+    Session           *session;
+    long               serial;          //of the session when the job was given
+    int                saveNo;          //jobSave: which of its states
+    StoreState        *state;           //jobSave
+    char               fname[220];      //the state file, or jobCopy: the output
+                                        //file ("" with a sink)
+    char              *base;            //jobCopy: the previous version
+    long long          baseId;
+    bool              *skip;            //jobCopy: blocks not to copy
+    int                blocks;
+    int                blkSize;
+    long long          length;          //of the file
+    Job               *next;
+};
+
+//Files received completely are listed in pxit-received, in the directory
+//they were written to, by transfer id and length.  A packet of a file on
+//the list is dropped as soon as its header has been read, so a carousel
+//repeating the file costs nothing more, even after a restart.  Every few
+//seconds a dropped packet checks that the file is still there, so one that
+//has since been deleted or renamed is received again.  Files sent with
+//the original header have no transfer id and are not listed.
+struct Received {
+    unsigned long long content;         //transfer id << 32 | length
+    char              *fname;
+    time_t             checked;         //when the file was last seen
+};
+
+const char receivedName[] = "pxit-received";
+
+const int maxSessions = 8;              //files followed at the same time
+const int stateInterval = 5;            //seconds between saves of the state
+const int maxBases = 16;                //previous versions for deltas
+const int baseExtent = 8 << 20;         //bytes copied from one at a time
+
+//A frame that repeats the last good one is recognized by sampling a few
+//cells where they were found in that frame: all of the header cells, which
+//tell one packet from another, and every 16th data cell, of which a few
+//may differ.
+const int repeatHeaderCells = extHeaderSize*4;
+const int repeatStride      = 16;
+const int repeatTolerance   = 8;
+const int maxRepeatCells    = repeatHeaderCells + ncells/repeatStride + 1;
+
+//Before decoding a frame, the center pixels of 56 cells spread over the
+//grid (none of them a fiducial) are compared with the palette colors.
+//Ordinary video seldom comes close to them; a pxit frame has almost every
+//sample on one of them, using at least three colors.  A frame is decoded
+//only if the given fraction of the samples match.  Lower fractions miss
+//fewer distorted pxit frames and let more ordinary video through to the
+//full decode; 0 decodes everything.
+const int    presenceSamples  = 56;
+const int    presenceRadius   = 100;    //RGB distance counted as a match
+const double presenceFraction = 0.4;    //default
+
+//A frame that fails its checksum is kept.  Playout often shows a frame
+//several times, with noise in different cells each time, so when three
+//of the frames kept differ in only a few cells they are taken to be
+//copies of one packet: each cell gets the symbol most of them agree on
+//(the newest copy breaks ties) and the result is checked again.
+const int softCopies    = 4;            //failed frames kept
+const int softMinCopies = 3;            //copies needed for a vote
+const int softMaxDiffer = ncells/8;     //cells in which copies may differ
+
+//Received files are written to the current directory, along with reports
+//of missing blocks and saved state.  Given an OutputSink, the processor
+//touches no files and hands the data to the sink instead.
+//
+//Several inputs can be combined into one reception: each thread decodes
+//frames with its own ImageProcessor, set to pass the packets it verifies
+//to a shared one (setCombiner()) that keeps the files.  The shared one
+//stores packets under a lock, so a block received on any input counts.
+//
+//Saving state every few seconds syncs the output file, which can take a
+//while on slow storage.  Decoding only takes a copy of the state; a
+//thread of the processor's own, started when first needed, writes it
+//out without holding the lock.  Only the latest state of a file that is
+//still being received replaces the saved one.  The same thread copies the
+//unchanged blocks of a delta.  checkpoint() waits for it to finish what
+//it was given.
 class ImageProcessor {
 public:
-    ImageProcessor();
+    ImageProcessor(OutputSink *sink = NULL);
     ~ImageProcessor();
-    int processImage(int *frame);
+    int processImage(const int *frame);
+    int processPacket(const unsigned char *pkt, int pktLen);  //e.g. from a journal
+    int storePacket(int tag, const unsigned char *pkt, int pktLen, bool fid);  //verified
     void getPixelstream(int *frame, char *pixelstream);  
+    int  getSymbols(const int *frame, char *pixelstream, int palette = paletteStandard);
+    void reportMissing();
+    void checkpoint();
+
+    //tiered decoding: detect() looks only at the presence sample points
+    void setPresence(double fraction) {presence = fraction;}
+    void setJournal(PacketJournal *j) {journal = j;}
+    bool addBase(const char *fname);    //a previous version deltas may apply to
+    void setTrace(Trace *t) {trace = t;}  //record the stages of each frame
+    void setCombiner(ImageProcessor *c) {combiner = c;}
+    bool detect(const int *frame);
+    const int *getPresenceOffsets() {return presenceOffsets;}
+
+    Metrics *getMetrics() {return &metrics;}
+    long blocksRemaining();
+    int  sessionsActive();
 private:
     //variables
-    bool         *BlockFlags;
-    int           blocksNeeded;
+    GridAligner  *aligner;
     CheckSum     *checksum;
-    //char          directory[200];
-    bool          fileComplete=false;
-    int           filelength;
+    long          clock=0;          //counts valid packets
     bool          gotFirstFrame=false;
-    int           lastBlockSize;
-    int           nBlocksFound;
-    FILE         *outputFile;
-    char          outputfname[200];
+    int           gridOffsets[ncells];
+    Metrics       metrics;
+    OutputSink   *sink;             //NULL to write files
+    PacketJournal *journal=NULL;    //records packets with new blocks
+    Trace        *trace=NULL;
+    ImageProcessor *combiner=NULL;  //stores our packets instead of us
+    pthread_mutex_t lock;           //held while the sessions are used
+    int           palette=paletteStandard;  //palette of the last good frame
+    int           lumaY[4], lumaCb[4], lumaCr[4];
     unsigned char packet[packetSize];
-    char          pixelstream[45*30];
-    int           previous=0;
-    int           sequence;  
+    char          pixelstream[ncells];
+    Session       sessions[maxSessions];
+    unsigned long long unwritableKey=~0ULL;  //file whose output couldn't be created
+    time_t        unwritableTime=0; //when it was last tried
+    char         *baseNames[maxBases];
+    unsigned int  baseIds[maxBases];
+    int           nBases=0;
+    Received     *received=NULL;    //sorted by content
+    int           nReceived=0, maxReceived=0;
+    bool          receivedLoaded=false;
+    double        presence=presenceFraction;
+    int           presenceOffsets[presenceSamples];
+    unsigned int  presenceColors[2*nPalettes*4];
+    int           nPresenceColors=0;
+    int           repeatCells=0;    //0 until a frame has been accepted
+    int           repeatOffsets[maxRepeatCells];
+    char          repeatSymbols[maxRepeatCells];
+    char          softSymbols[softCopies][ncells];  //recent failed frames
+    int           softSamples[softCopies] = {0};    //their symbol counts, 0 if unused
+    int           softNext=0;
+    bool          bandsFirst=false; //the last good frame was banded
+    long          sessionCount=0;
+    pthread_t     worker;           //does the jobs
+    Trace        *workerTrace=NULL; //its spans
+    bool          workerStarted=false;
+    bool          stopping=false;   //the worker should finish up
+    pthread_cond_t jobReady, jobsDone;
+    Job          *jobs=NULL, **jobsEnd=&jobs;
+    int           jobsPending=0;    //given to the worker and not yet done
 
     //methods
-    void getDataPacket(char *pixelstream, unsigned char* packet);
-    void resetDecoder();
+    void span(const char *name, long long t0, long long t1) {
+        Trace *t = workerStarted && pthread_equal(pthread_self(), worker) ? workerTrace : trace;
+        if(t) t->span(name, t0, t1);
+    }
+    int  acceptPacket(int tag, int pktLen, bool fid);
+    bool acceptManifest(Session *s, int part, const unsigned char *data, int len);
+    void checkComplete(Session *s);
+    void copyFromBase(Session *s);
+    void loadReceived();
+    int  findReceived(unsigned long long content);
+    void addReceived(unsigned long long content, const char *fname);
+    void classify(const int *frame, const int *offsets, int n, char *pixelstream,
+                  int palette);
+    void endSession(Session *s);
+    Session *findSession(unsigned long long key);
+    void getDataPacket(char *pixelstream, unsigned char* packet, int pktLen);
+    bool isRepeat(const int *frame);
+    bool combineCopies(int cur, int nsamples);
+    int  checkSymbols(int pktLen, bool fid, int *failed, long long *packTime,
+                      long long *verifyTime);
+    int  checkPackets(int len, bool fid, int *failed, long long *packTime,
+                      long long *verifyTime);
+    void rememberFrame(const int *offsets, int nsamples);
+    Session *newSession(unsigned long long key, long long id, long long length, int blkLen);
+    void reportMissing(Session *s);
+    void saveState(Session *s);
+    void saveLater(Session *s);
+    void finishSave(Job *job);
+    void finishCopy(Job *job);
+    void submit(Job *job);
+    void drain();
+    void work();
+    static void *runWorker(void *processor);
+    void stateName(Session *s, char *fname);
 };
 
 
@@ -0,0 +1,161 @@
+//Metrics.cpp - counts, times and exports what the decoder is doing
+
+/*Copyright (c) 2020, Frank J. LoPinto
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.*/
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "Metrics.h"
+
+static const char *counterNames[nCounters][2] = {
+    {"pxit_frames_total",           "Frames handed to the decoder"},
+    {"pxit_frames_idle_total",      "Frames without a pxit pattern that were not decoded"},
+    {"pxit_frames_aligned_total",   "Frames in which the fiducials were found"},
+    {"pxit_frames_repeated_total",  "Copies of the last good frame that were not decoded again"},
+    {"pxit_packets_combined_total", "Packets recovered by combining failed copies of a frame"},
+    {"pxit_checksum_pass_total",    "Packets with a valid checksum"},
+    {"pxit_checksum_fail_total",    "Packets with a bad checksum"},
+    {"pxit_blocks_new_total",       "Blocks written to an output file"},
+    {"pxit_blocks_duplicate_total", "Valid packets for blocks already received"},
+    {"pxit_blocks_base_total",      "Delta blocks copied from the previous version"},
+    {"pxit_blocks_known_total",     "Valid packets for files already received that were dropped"},
+    {"pxit_files_complete_total",   "Files received completely"},
+    {"pxit_files_corrupt_total",    "Files received that did not match their hash or could not be written"},
+};
+
+static const char *stageNames[nStages] = {"input", "align", "classify", "verify", "write"};
+
+Metrics::Metrics() {
+    memset(counters, 0, sizeof(counters));
+    memset(buckets, 0, sizeof(buckets));
+    memset(samples, 0, sizeof(samples));
+    memset(seconds, 0, sizeof(seconds));
+}
+
+long long Metrics::now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void Metrics::timeStage(int stage, long long ns) {
+
+    //Bucket b holds times up to 2**b microseconds, compared in nanoseconds
+    //so that the boundaries are exact
+    int b = 0;
+    while(b < nBuckets-1 && ns > (1000LL << b)) b++;
+
+    buckets[stage][b]++;
+    samples[stage]++;
+    seconds[stage] += ns * 1e-9;
+}
+
+void Metrics::add(const Metrics &m) {
+    for(int i=0;i<nCounters;i++) counters[i] += m.counters[i];
+    for(int s=0;s<nStages;s++) {
+        for(int b=0;b<nBuckets;b++) buckets[s][b] += m.buckets[s][b];
+        samples[s] += m.samples[s];
+        seconds[s] += m.seconds[s];
+    }
+}
+
+MetricsExporter::MetricsExporter(const char *fname, int Interval) {
+
+    //The tools change directory after reading their arguments, so keep
+    //the full path
+    filename[0] = 0;
+    if(fname[0] != '/' && getcwd(filename, 100)) strcat(filename, "/");
+    strncat(filename, fname, 99);
+    interval   = Interval;
+    lastTime   = Metrics::now();
+    lastFrames = lastBlocks = 0;
+}
+
+bool MetricsExporter::due() {
+    return Metrics::now() - lastTime >= interval * 1000000000LL;
+}
+
+void MetricsExporter::write(const Metrics &m, long blocksRemaining, int sessionsActive) {
+
+    //Rates are measured over the time since the last export
+    long long t = Metrics::now();
+    double dt = (t - lastTime) * 1e-9;
+    double fps = 0, bps = 0;
+    if(dt > 0) {
+        fps = (m.counters[framesSeen] - lastFrames) / dt;
+        bps = (m.counters[blocksNew]  - lastBlocks) / dt;
+    }
+    lastTime   = t;
+    lastFrames = m.counters[framesSeen];
+    lastBlocks = m.counters[blocksNew];
+
+    //Write a new file and rename it over the old one so readers never see
+    //a partial export
+    char tmp[220];
+    sprintf(tmp, "%s.tmp", filename);
+    FILE *fp = fopen(tmp, "w");
+    if(!fp) {
+        perror("fopen");
+        return;
+    }
+
+    for(int i=0;i<nCounters;i++) {
+        fprintf(fp, "# HELP %s %s\n", counterNames[i][0], counterNames[i][1]);
+        fprintf(fp, "# TYPE %s counter\n", counterNames[i][0]);
+        fprintf(fp, "%s %lu\n", counterNames[i][0], m.counters[i]);
+    }
+
+    fprintf(fp, "# HELP pxit_frames_per_second Frames decoded per second\n");
+    fprintf(fp, "# TYPE pxit_frames_per_second gauge\n");
+    fprintf(fp, "pxit_frames_per_second %.2f\n", fps);
+    fprintf(fp, "# HELP pxit_sessions_active Files being received\n");
+    fprintf(fp, "# TYPE pxit_sessions_active gauge\n");
+    fprintf(fp, "pxit_sessions_active %d\n", sessionsActive);
+    fprintf(fp, "# HELP pxit_blocks_remaining Blocks still needed by unfinished files\n");
+    fprintf(fp, "# TYPE pxit_blocks_remaining gauge\n");
+    fprintf(fp, "pxit_blocks_remaining %ld\n", blocksRemaining);
+
+    //Time to completion at the rate new blocks arrived recently.  -1 if
+    //nothing arrived.
+    fprintf(fp, "# HELP pxit_eta_seconds Estimated time until unfinished files complete\n");
+    fprintf(fp, "# TYPE pxit_eta_seconds gauge\n");
+    fprintf(fp, "pxit_eta_seconds %.0f\n", bps > 0 ? blocksRemaining / bps : -1.0);
+
+    fprintf(fp, "# HELP pxit_stage_seconds Time spent in each stage of decoding a frame\n");
+    fprintf(fp, "# TYPE pxit_stage_seconds histogram\n");
+    for(int s=0;s<nStages;s++) {
+        unsigned long cumulative = 0;
+        for(int b=0;b<nBuckets-1;b++) {
+            cumulative += m.buckets[s][b];
+            fprintf(fp, "pxit_stage_seconds_bucket{stage=\"%s\",le=\"%g\"} %lu\n",
+                    stageNames[s], (1 << b) * 1e-6, cumulative);
+        }
+        fprintf(fp, "pxit_stage_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %lu\n",
+                stageNames[s], m.samples[s]);
+        fprintf(fp, "pxit_stage_seconds_sum{stage=\"%s\"} %.6f\n", stageNames[s], m.seconds[s]);
+        fprintf(fp, "pxit_stage_seconds_count{stage=\"%s\"} %lu\n", stageNames[s], m.samples[s]);
+    }
+
+    fclose(fp);
+    if(rename(tmp, filename) < 0) perror("rename");
+}
@@ -0,0 +1,72 @@
+//Metrics.h - counters and stage timings for the decoding pipeline
+#ifndef METRICS_H
+#define METRICS_H
+#include <time.h>
+
+/* Each thread that decodes frames keeps its own Metrics, so counting costs
+ * an add and timing a stage costs two clock reads.  A MetricsExporter
+ * periodically writes them in the Prometheus text format to a file that a
+ * node_exporter textfile collector (or a person with 'cat') can read.
+ */
+
+enum Counter {
+    framesSeen,         //frames handed to the decoder
+    framesIdle,         //frames without a pxit pattern, not decoded
+    framesAligned,      //frames in which the fiducials were found
+    framesRepeated,     //copies of the last good frame, not decoded again
+    packetsCombined,    //packets recovered from several failed copies
+    checksumPass,
+    checksumFail,
+    blocksNew,          //blocks written to an output file
+    blocksDuplicate,    //valid packets for blocks we already had
+    blocksFromBase,     //delta blocks copied from the previous version
+    blocksKnown,        //valid packets for files already received, dropped
+    filesComplete,
+    filesCorrupt,       //finished files that didn't match their hash or
+                        //couldn't be written
+    nCounters
+};
+
+enum Stage {
+    stageInput,         //reading a TGA file or converting a captured frame
+    stageAlign,         //locating fiducials
+    stageClassify,      //sampling cells and packing bytes
+    stageVerify,        //checksum
+    stageWrite,         //storing a new block
+    nStages
+};
+
+const int nBuckets = 17;        //powers of two from 1 us to 32 ms, then +Inf
+
+class Metrics {
+public:
+    Metrics();
+
+    void count(int counter, unsigned long n = 1) {counters[counter] += n;}
+    void timeStage(int stage, long long ns);
+    void add(const Metrics &m);         //merge counts from another thread
+
+    static long long now();             //monotonic clock in nanoseconds
+
+    unsigned long counters[nCounters];
+    unsigned long buckets[nStages][nBuckets];
+    unsigned long samples[nStages];
+    double        seconds[nStages];
+};
+
+class MetricsExporter {
+public:
+    MetricsExporter(const char *fname, int interval = 10);
+
+    bool due();                         //true when the interval has passed
+    void write(const Metrics &m, long blocksRemaining, int sessionsActive);
+
+private:
+    char          filename[200];
+    int           interval;             //seconds between exports
+    long long     lastTime;             //when we last wrote
+    unsigned long lastFrames;           //counters at that time, for rates
+    unsigned long lastBlocks;
+};
+
+#endif // METRICS_H
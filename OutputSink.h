@@ -0,0 +1,34 @@
+//OutputSink.h - receives the data of files as a Decoder reassembles them
+#ifndef OUTPUTSINK_H
+#define OUTPUTSINK_H
+
+//What the decoder knows about a file being received.  The key is unique
+//among the files being received at the same time.
+struct TransferInfo {
+    unsigned long long key;
+    long long          id;              //transfer id, -1 for the original header
+    long long          length;          //bytes
+    int                blockSize;       //bytes of the file carried by each frame
+    int                blocks;          //frames needed for the whole file
+    int                verified;        //on complete(): 1 if the file matched the
+                                        //hash sent with it, -1 if not, 0 if none
+};
+
+/* An application that decodes frames in memory (see Decoder.h) implements
+ * an OutputSink to be told about files as they arrive.  Each block is
+ * delivered once, in whatever order it is received, and complete() is
+ * called when every block of a file has been delivered.  A file that
+ * is given up to make room for others may begin() again later, and its
+ * blocks are then delivered again.
+ */
+class OutputSink {
+public:
+    virtual ~OutputSink() {}
+
+    virtual void begin(const TransferInfo &t) = 0;
+    virtual void block(const TransferInfo &t, int sequence, long long offset,
+                       const unsigned char *data, int len) = 0;
+    virtual void complete(const TransferInfo &t) = 0;
+};
+
+#endif // OUTPUTSINK_H
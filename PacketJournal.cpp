@@ -0,0 +1,139 @@
+//PacketJournal.cpp - append-only record of verified packets
+
+/*Copyright (c) 2020, Frank J. LoPinto
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.*/
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include "PacketJournal.h"
+#include "pxit-parms.h"
+
+static const char journalMagic[8] = {'P','X','J','R','N','L','1','\n'};
+
+PacketJournal::PacketJournal(int Fd, uint32_t Source) {
+    fd     = Fd;
+    source = Source;
+}
+
+PacketJournal::~PacketJournal() {
+    close(fd);
+}
+
+PacketJournal *PacketJournal::open(const char *fname, uint32_t source) {
+    int fd = ::open(fname, O_RDWR | O_APPEND | O_CREAT, 0644);
+    if(fd < 0) {
+        perror(fname);
+        return NULL;
+    }
+
+    //A new journal gets the magic number; an old one has to have it
+    char magic[8];
+    int n = pread(fd, magic, 8, 0);
+    if(n == 0) {
+        if(write(fd, journalMagic, 8) != 8) {
+            perror(fname);
+            close(fd);
+            return NULL;
+        }
+    } else if(n != 8 || memcmp(magic, journalMagic, 8)) {
+        printf("%s is not a packet journal\n", fname);
+        close(fd);
+        return NULL;
+    }
+    return new PacketJournal(fd, source);
+}
+
+bool PacketJournal::append(const unsigned char *packet, int len) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    uint64_t t = (uint64_t)tv.tv_sec*1000000 + tv.tv_usec;
+
+    unsigned char record[journalHeaderSize + packetSize];
+    memset(record, 0, journalHeaderSize);
+    record[0] = len;
+    record[1] = len >> 8;
+    for(int i=0;i<4;i++) record[4+i] = source >> (8*i);
+    for(int i=0;i<8;i++) record[8+i] = t >> (8*i);
+    memcpy(record + journalHeaderSize, packet, len);
+
+    //One write, so records from a crash are whole or at the very end
+    int n = journalHeaderSize + len;
+    if(write(fd, record, n) != n) {
+        perror("journal");
+        return false;
+    }
+    return true;
+}
+
+void PacketJournal::sync() {
+    if(fdatasync(fd) < 0) perror("journal");
+}
+
+JournalReader::JournalReader() {
+    fp = NULL;
+    shortRecord = false;
+}
+
+JournalReader::~JournalReader() {
+    if(fp) fclose(fp);
+}
+
+bool JournalReader::open(const char *fname) {
+    if(fp) fclose(fp);
+    shortRecord = false;
+    fp = fopen(fname, "rb");
+    if(!fp) {
+        perror(fname);
+        return false;
+    }
+    char magic[8];
+    if(fread(magic, 1, 8, fp) != 8 || memcmp(magic, journalMagic, 8)) {
+        printf("%s is not a packet journal\n", fname);
+        fclose(fp);
+        fp = NULL;
+        return false;
+    }
+    return true;
+}
+
+bool JournalReader::next(JournalRecord *record, unsigned char *packet) {
+    if(!fp) return false;
+
+    unsigned char h[journalHeaderSize];
+    int n = fread(h, 1, journalHeaderSize, fp);
+    if(n == 0) return false;
+    record->length = h[0] | (h[1] << 8);
+    record->source = 0;
+    record->time   = 0;
+    for(int i=3;i>=0;i--) record->source = (record->source << 8) | h[4+i];
+    for(int i=7;i>=0;i--) record->time   = (record->time << 8) | h[8+i];
+
+    if(n != journalHeaderSize || record->length > packetSize ||
+       fread(packet, 1, record->length, fp) != (size_t)record->length) {
+        shortRecord = true;
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,64 @@
+//PacketJournal.h - append-only record of verified packets
+#ifndef PACKETJOURNAL_H
+#define PACKETJOURNAL_H
+#include <stdint.h>
+#include <stdio.h>
+
+/* A decoder given a journal appends every verified packet that brought it
+ * a new block, exactly as received (header, data and check bytes), so
+ * receptions from different nights or receivers can be combined later by
+ * pxit-merge without going back to the video.
+ *
+ * Format.  The file starts with the 8 bytes "PXJRNL1\n".  Each record is a
+ * 16-byte header, little-endian, followed by the packet:
+ *
+ *     uint16  packet length (337, or 333 for frames with fiducials; a
+ *             band's packet is 112, or 111, see pxit-parms.h)
+ *     uint16  reserved, 0
+ *     uint32  source id, chosen by whoever runs the receiver
+ *     uint64  time received, microseconds since 1970
+ *
+ * Records are only ever appended, each with a single write, so a crash
+ * can at worst leave a short record at the end, which readers ignore.
+ * The packet's own check bytes protect the rest.
+ */
+
+const int journalHeaderSize = 16;
+
+struct JournalRecord {
+    int       length;
+    uint32_t  source;
+    uint64_t  time;
+};
+
+class PacketJournal {
+public:
+    ~PacketJournal();
+
+    static PacketJournal *open(const char *fname, uint32_t source);  //create or append
+
+    bool append(const unsigned char *packet, int len);
+    void sync();
+
+private:
+    PacketJournal(int fd, uint32_t source);
+
+    int      fd;
+    uint32_t source;
+};
+
+class JournalReader {
+public:
+    JournalReader();
+    ~JournalReader();
+
+    bool open(const char *fname);
+    bool next(JournalRecord *record, unsigned char *packet);  //false at the end
+    bool truncated() {return shortRecord;}     //stopped at a short or damaged record
+
+private:
+    FILE *fp;
+    bool  shortRecord;
+};
+
+#endif // PACKETJOURNAL_H
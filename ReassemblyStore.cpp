@@ -0,0 +1,289 @@
+//ReassemblyStore.cpp - writes received blocks into a preallocated output file
+
+/*Copyright (c) 2020, Frank J. LoPinto
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "ReassemblyStore.h"
+#include "checksum.h"
+
+//Ask the kernel to start writing back dirty pages after this many bytes.
+const long long flushInterval = 4 << 20;
+
+ReassemblyStore::ReassemblyStore() {
+    BlockFlags = NULL;
+    blocksNeeded = nBlocksFound = 0;
+    fd = -1;
+    filename[0] = 0;
+}
+
+ReassemblyStore::~ReassemblyStore() {
+    if(fd >= 0) close(fd);
+    delete [] BlockFlags;
+}
+
+void ReassemblyStore::setup(const char *fname, long long length, int blkSize, long long id) {
+    strcpy(filename, fname ? fname : "");
+    filelength = length;
+    blockSize  = blkSize;
+    transferId = id;
+    unflushed  = 0;
+    unsaved    = 0;
+    hashSum    = 0;
+
+    //Compute number of data blocks (packets) needed and the size of the last one.
+    blocksNeeded  = filelength / blockSize;
+    lastBlockSize = filelength - (long long)blocksNeeded*blockSize;
+    if (lastBlockSize) blocksNeeded++;  //last block is partially filled
+    else lastBlockSize = blockSize;
+
+    delete [] BlockFlags;
+    BlockFlags = new bool[blocksNeeded];    //bool array for each block we'll need
+    for (int i = 0; i < blocksNeeded; i++)
+        BlockFlags[i] = false;              //no blocks have been processed yet
+    nBlocksFound = 0;
+}
+
+bool ReassemblyStore::create(const char *fname, long long length, int blkSize, long long id) {
+    setup(fname, length, blkSize, id);
+
+    if(fd >= 0) close(fd);  //abandon any earlier file
+    fd = -1;
+    if(!fname) return true; //only keep track of the blocks
+    fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) {
+        perror(filename);
+        return false;
+    }
+
+    //Reserve the whole file now so blocks arriving in random order don't
+    //fragment it.  Filesystems without fallocate get a sparse file instead.
+    //A file that can't be made full size is no use, so it goes.
+    if(fallocate(fd, 0, 0, filelength) < 0) {
+        if(errno != EOPNOTSUPP || ftruncate(fd, filelength) < 0) {
+            perror("fallocate");
+            close(fd);
+            fd = -1;
+            unlink(filename);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool ReassemblyStore::hasBlock(int sequence) {
+    return sequence < 0 || sequence >= blocksNeeded || BlockFlags[sequence];
+}
+
+int ReassemblyStore::putBlock(int sequence, const unsigned char *data) {
+
+    //have we seen this sequence number before?
+    if(hasBlock(sequence)) return 0;
+
+    //No, this is a new one.  Copy user data to its place in the file.  A
+    //block that couldn't be written isn't counted, so it is taken again
+    //when it is sent again.
+    int bytesToCopy = blockLength(sequence);
+    if(fd >= 0 && pwrite(fd, data, bytesToCopy, (off_t)sequence*blockSize) != bytesToCopy) {
+        perror(filename);
+        return -1;
+    }
+
+    //Update records
+    BlockFlags[sequence] = true;
+    nBlocksFound++;
+    unsaved++;
+    hashSum += CheckSum::blockHash(sequence, data, bytesToCopy);
+
+    //Start writeback in the background every few megabytes
+    unflushed += bytesToCopy;
+    if(fd >= 0 && unflushed >= flushInterval) {
+        sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+        unflushed = 0;
+    }
+    return true;
+}
+
+//markBlock() records a block the caller has written to the file itself,
+//given its CheckSum::blockHash().  Returns false if we already had it.
+bool ReassemblyStore::markBlock(int sequence, unsigned long long hash) {
+    if(hasBlock(sequence)) return false;
+    BlockFlags[sequence] = true;
+    nBlocksFound++;
+    unsaved++;
+    hashSum += hash;
+    return true;
+}
+
+int ReassemblyStore::blockLength(int sequence) {
+    return sequence + 1 == blocksNeeded ? lastBlockSize : blockSize;
+}
+
+unsigned long long ReassemblyStore::contentHash() {
+    return hashSum;
+}
+
+bool ReassemblyStore::isComplete() {
+    return blocksNeeded > 0 && nBlocksFound == blocksNeeded;
+}
+
+bool ReassemblyStore::finish() {
+    if(fd < 0) return true;
+    bool ok = fsync(fd) == 0;
+    if(!ok) perror(filename);
+    if(close(fd) < 0) {
+        perror(filename);
+        ok = false;
+    }
+    fd = -1;
+    return ok;
+}
+
+int ReassemblyStore::writeMissing(const char *fname) {
+    FILE *fp = fopen(fname, "w");
+    if(!fp) {
+        perror("fopen");
+        return -1;
+    }
+
+    fprintf(fp, "pxit-missing\n");
+    fprintf(fp, "length %lld\n", filelength);
+    fprintf(fp, "blocksize %d\n", blockSize);
+    if(transferId >= 0) fprintf(fp, "id %08llx\n", transferId);
+
+    //Write each run of missing blocks as a range
+    int nMissing = 0;
+    for(int i=0;i<blocksNeeded;i++) {
+        if(BlockFlags[i]) continue;
+        int first = i;
+        while(i+1 < blocksNeeded && !BlockFlags[i+1]) i++;
+        if(first == i) fprintf(fp, "%d\n", i);
+        else           fprintf(fp, "%d-%d\n", first, i);
+        nMissing += i - first + 1;
+    }
+    fclose(fp);
+    return nMissing;
+}
+
+bool ReassemblyStore::saveState(const char *stateFile, unsigned long long key) {
+
+    //Write a new copy and rename it over the old one, so a crash leaves
+    //either the old state or the new one
+    char tmp[220];
+    sprintf(tmp, "%s.tmp", stateFile);
+    StoreState *state = takeState(key);
+    bool ok = writeState(state, tmp);
+    delete state;
+    if(ok && rename(tmp, stateFile) < 0) {
+        perror("rename");
+        ok = false;
+    }
+    return ok;
+}
+
+//takeState() copies the state as it is now.  The blocks it marks no longer
+//count as unsaved.
+StoreState *ReassemblyStore::takeState(unsigned long long key) {
+    StoreState *state = new StoreState;
+    if(fd >= 0) state->fd = dup(fd);
+
+    char header[400];
+    int hdrLen = sprintf(header,
+                         "pxit-state\nkey %llx\noutput %s\nlength %lld\nblocksize %d\nid %lld\nhash %llx\n",
+                         key, filename, filelength, blockSize, transferId, hashSum);
+    state->length = hdrLen + (blocksNeeded + 7)/8;
+    state->data = new char[state->length];
+    memcpy(state->data, header, hdrLen);
+
+    //one bit per block, least significant bit first
+    unsigned char *bits = (unsigned char *)state->data + hdrLen;
+    memset(bits, 0, (blocksNeeded + 7)/8);
+    for(int i=0;i<blocksNeeded;i++)
+        if(BlockFlags[i]) bits[i/8] |= 1 << (i%8);
+
+    unsaved = 0;
+    return state;
+}
+
+bool ReassemblyStore::writeState(StoreState *state, const char *fname) {
+
+    //Blocks marked in the state have to be on disk before the state is
+    if(state->fd >= 0 && fdatasync(state->fd) < 0) perror("fdatasync");
+
+    FILE *fp = fopen(fname, "wb");
+    if(!fp) {
+        perror("fopen");
+        return false;
+    }
+    bool ok = fwrite(state->data, 1, state->length, fp) == (size_t)state->length;
+    ok = fflush(fp) == 0 && ok;
+    ok = fsync(fileno(fp)) == 0 && ok;
+    ok = fclose(fp) == 0 && ok;
+    if(!ok) perror(fname);
+    return ok;
+}
+
+StoreState::~StoreState() {
+    if(fd >= 0) close(fd);
+    delete [] data;
+}
+
+bool ReassemblyStore::resume(const char *stateFile, unsigned long long key) {
+    FILE *fp = fopen(stateFile, "rb");
+    if(!fp) return false;
+
+    unsigned long long k;
+    char fname[200];
+    unsigned long long hash;
+    long long length, id;
+    int blkSize;
+    if(fscanf(fp, "pxit-state key %llx output %199s length %lld blocksize %d id %lld hash %llx",
+              &k, fname, &length, &blkSize, &id, &hash) != 6 || k != key || fgetc(fp) != '\n') {
+        printf("Ignoring unreadable state %s\n", stateFile);
+        fclose(fp);
+        return false;
+    }
+
+    setup(fname, length, blkSize, id);
+    hashSum = hash;
+    int byte = 0;
+    for(int i=0;i<blocksNeeded;i++) {
+        if(i%8 == 0 && (byte = fgetc(fp)) == EOF) break;
+        if(byte & (1 << (i%8))) {
+            BlockFlags[i] = true;
+            nBlocksFound++;
+        }
+    }
+    fclose(fp);
+
+    if(fd >= 0) close(fd);
+    fd = open(filename, O_WRONLY);
+    if(fd < 0) {
+        perror(filename);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,92 @@
+//ReassemblyStore.h - output file and block records for a file being received
+#ifndef REASSEMBLYSTORE_H
+#define REASSEMBLYSTORE_H
+
+/* The store preallocates the whole output file as soon as its length is
+ * known and writes each block in place with pwrite().  Dirty pages are
+ * handed to the kernel for writeback in batches so that a long transfer
+ * never piles up a large flush, and the file is synced once on completion.
+ * A block is only counted once it has been written in full, and a file
+ * that can't be created at full length is removed again.
+ *
+ * writeMissing() saves the sequence numbers still missing as a short text
+ * report that pxit-encoder -m accepts, so only those frames are re-sent:
+ *
+ *     pxit-missing
+ *     length 20000
+ *     blocksize 328
+ *     id 9c3e01a7          (files sent with an extended header only)
+ *     5-6
+ *     12
+ *
+ * saveState() records enough to carry on after a restart: a text header
+ * naming the session and its output file, then one bit per block.  The
+ * output file is synced first, so every block marked in the state really
+ * is on disk.  resume() reopens the output file from a saved state.  To
+ * save without waiting for the disk, takeState() copies the state, which
+ * is quick, and writeState() syncs the file and writes the copy out, from
+ * another thread if need be.
+ *
+ * A store created without a filename only keeps track of the blocks; the
+ * caller does something else with the data.
+ *
+ * contentHash() is the sum of CheckSum::blockHash() over the blocks
+ * received, added up as each one is written, so checking a finished file
+ * doesn't read it back.  The saved state carries the sum for the blocks it
+ * marks, so blocks written before a restart count too.
+ */
+//A copy of the state of a store, to be written out later
+struct StoreState {
+    int   fd;                   //duplicate of the output file, -1 if none
+    char *data;                 //what saveState() would write
+    int   length;
+
+    StoreState() {fd = -1; data = NULL; length = 0;}
+    ~StoreState();
+};
+
+class ReassemblyStore {
+public:
+    ReassemblyStore();
+    ~ReassemblyStore();
+
+    bool create(const char *fname, long long length, int blkSize, long long id = -1);  //fname NULL: no file
+    bool resume(const char *stateFile, unsigned long long key);
+    bool saveState(const char *stateFile, unsigned long long key);
+    StoreState *takeState(unsigned long long key);
+    static bool writeState(StoreState *state, const char *fname);  //doesn't rename
+    bool hasBlock(int sequence);
+    int  putBlock(int sequence, const unsigned char *data);  //1 new, 0 seen, -1 not written
+    bool markBlock(int sequence, unsigned long long hash);  //written by the caller
+    bool isComplete();
+    bool finish();                                          //sync and close the file
+    int  writeMissing(const char *fname);                   //returns number of missing blocks
+    int  blockLength(int sequence);                         //bytes of the file in a block
+    unsigned long long contentHash();
+
+    int         getBlocksNeeded() {return blocksNeeded;}
+    int         getBlockSize()    {return blockSize;}
+    long long   getLength()       {return filelength;}
+    long long   getTransferId()   {return transferId;}
+    int         getBlocksFound()  {return nBlocksFound;}
+    int         getUnsaved()      {return unsaved;}
+    const char *getFilename()     {return filename;}
+
+private:
+    bool      *BlockFlags;
+    int        blocksNeeded;
+    int        blockSize;
+    long long  filelength;
+    char       filename[200];
+    int        fd;
+    int        lastBlockSize;
+    int        nBlocksFound;
+    long long  transferId;      //-1 for files sent with the original header
+    long long  unflushed;       //bytes written since the last writeback request
+    int        unsaved;         //blocks received since the state was saved
+    unsigned long long hashSum; //of the blocks received
+
+    void setup(const char *fname, long long length, int blkSize, long long id);
+};
+
+#endif // REASSEMBLYSTORE_H
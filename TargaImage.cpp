@@ -28,46 +28,83 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.*/
 
 #include "TargaImage.h"
 
-long *TargaImage::getFrame() {return frame;}
+int *TargaImage::getFrame() {return frame;}
 
 TargaImage::TargaImage(int Width, int Height) { //ctor for writing images
 
 	tga = NULL; 
-	frame = new long[Width*Height];
+	frame = new int[Width*Height];
+	ownFrame = true;
 	memset(frame,0,4*Width*Height);
 
 	header.width  = _width  = Width;
 	header.height = _height = Height; 
     
     overwriteOK = true;  //disable check for existing file.
+	valid = complete = true;
 
 }//end ctor
 
 TargaImage::TargaImage(char *Filename, int Width, int Height) {//ctor (reading)
 
-	frame = new long[Width*Height];
-	memset(frame,0,4*Width*Height);
+	frame = new int[Width*Height];
+	ownFrame = true;
 
 	 //Store image geometry in class variables
 	 _width  = Width;  
 	 _height = Height;
+	tga = NULL;
+
+	read(Filename);
+}//end ctor
+
+TargaImage::TargaImage(int Width, int Height, int *buffer) {//ctor (caller's memory)
+
+	frame = buffer;
+	ownFrame = false;
+	memset(frame,0,4*Width*Height);
+
+	header.width  = _width  = Width;
+	header.height = _height = Height; 
+	tga = NULL;
+    overwriteOK = true;
+	valid = complete = true;
+}//end ctor
+
+TargaImage::~TargaImage() {
+	if(ownFrame) delete [] frame;
+}
+
+bool TargaImage::read(const char *Filename) {
+	memset(frame,0,4*_width*_height);
 
 	//Store filename (may be useful for diagnostic messages)
-	strcpy(filename,Filename);
+	strncpy(filename,Filename,sizeof(filename)-1);
+	filename[sizeof(filename)-1] = 0;
 
-	//Open the file containing the image
+	//Open the file containing the image.  Errors leave a black frame and
+	//isValid() false for the caller to deal with.
+	valid = complete = false;
 	tga = fopen(filename,"rb");
 	if(!tga) {
 		printf("TargaImage: error opening %s\n",filename);
 		perror("ERROR");
-		exit(0);
-	} else
-		readheader(tga); //Read and validate the header
+		return false;
+	}
 
-    decode(tga);
-}//end ctor
+	if(readheader(tga)) { //Read and validate the header
+		complete = decode(tga);
+		valid = true;
+	}
+	fclose(tga);
+	tga = NULL;
+	return valid;
+}
 
-void  TargaImage::decode(FILE *tga) {
+//decode() returns false if the file ends before the image does, which
+//leaves the rest of the frame black
+bool  TargaImage::decode(FILE *tga) {
+	bool whole = true;
 
 	if(header.img_type == 10) {  //Header indicates Run Length Encoded (RLE)
 		
@@ -75,57 +112,44 @@ void  TargaImage::decode(FILE *tga) {
 		//if(header.bpp == 24)	bpp = 3;
 		//else					bpp = 4;
 
+		//Packets may run from one row into the next, so treat the image as
+		//one long row.  Pixels are stored blue, green, red (, alpha).
 		unsigned char rle_hdr;
-		for(int y = 0; y < _height; y++) {
-			int x = 0;
-
-			while(x < _width) {
-				fread(&rle_hdr,1,1,tga);
-				int RLE = rle_hdr & 0x80;
-				int packetLength = (rle_hdr & 0x7F) + 1;
-				long color;
-				int j;
-				int nBytes = 3;
-				if(header.bpp == 32) nBytes = 3;
-
-				if(RLE) { //Process an RLE packet 
-					fread(&color,nBytes,1,tga);
-					color |= 0xFF000000;
-					for(j=0; j<packetLength; j++)
-					   *(frame + y * _width + x++) = color;
-
-				} else { //Process a raw packet
-
-					for(j=0; j<packetLength; j++) {
-					   fread(&color,nBytes,1,tga);
-					   *(frame + y*_width + x++) = color;	      
-					}
-				}
-			}//while   
-		}//end for
+		unsigned char px[4];
+		int nBytes = header.bpp/8;
+		int x = 0, npixels = _width*_height;
+
+		while(x < npixels && fread(&rle_hdr,1,1,tga) == 1) {
+			int RLE = rle_hdr & 0x80;
+			int packetLength = (rle_hdr & 0x7F) + 1;
+			if(packetLength > npixels - x) packetLength = npixels - x;
+
+			for(int j=0; j<packetLength; j++) {
+				//an RLE packet holds one pixel, a raw packet holds them all
+				if((j == 0 || !RLE) && fread(px,nBytes,1,tga) != 1) return false;
+				*(frame + x++) = 0xFF000000 | (px[2] << 16) | (px[1] << 8) | px[0];
+			}
+		}
+		whole = x == npixels;
 
 	} else if(header.bpp == 32) { //non-encoded, 32-bit image
-		fread(frame,4,_width*_height,tga);
+		whole = fread(frame,4,_width*_height,tga) == (size_t)(_width*_height);
 
 	} else if(header.bpp == 24) { //non-encoded, 24-bit image.Convert to 32
-		long *tmp = new long[_width*_height];
+		unsigned char *tmp = new unsigned char[3*_width*_height];
 		memset(tmp,0,3*_width*_height);
-		fread(tmp,3,_width*_height,tga);
-		char *sptr = (char *)tmp;
-		char *fptr = (char *)frame;
-
-		for(int i=0;i<_width*_height;i++) {
-			*fptr++ = *sptr++;
-			*fptr++ = *sptr++;
-			*fptr++ = *sptr++;
-			*fptr++ = (char)0xFF;
-		}
+		whole = fread(tmp,3,_width*_height,tga) == (size_t)(_width*_height);
+		unsigned char *sptr = tmp;
+
+		for(int i=0;i<_width*_height;i++, sptr += 3)
+			frame[i] = 0xFF000000 | (sptr[2] << 16) | (sptr[1] << 8) | sptr[0];
 		delete [] tmp;
 	}
 
-	//Do we need to invert the image?
-	if(header.misc != 0x20) {  //Yes, invert.
-		long color;
+	//Do we need to invert the image?  Bit 5 of the descriptor is set when
+	//the first row is the top one.
+	if(!(header.misc & 0x20)) {  //Yes, invert.
+		int color;
 		//Now flip the image
 		for(int row = 0; row < _height/2; row ++)
 			for(int col = 0;col < _width; col ++) {
@@ -135,17 +159,18 @@ void  TargaImage::decode(FILE *tga) {
 			   *(frame + _width*(_height-1-row) + col) = color;
 			}
 	}
+	return whole;
 
 }//end decode
 
-void TargaImage::fillBox(int top,int bottom,int left,int right,long color){
+void TargaImage::fillBox(int top,int bottom,int left,int right,int color){
   int row, col;
   for(row = top;row < bottom; row++)
     for(col=left; col<right; col++)
       *(frame + header.width*row + col) = color;
 }
 
-void TargaImage::writeFile(char *name, int bpp) {
+bool TargaImage::writeFile(char *name, int bpp) {
 
 	FILE *tga=NULL;
 
@@ -153,18 +178,18 @@ void TargaImage::writeFile(char *name, int bpp) {
   tga = fopen(name,"wb");
   if(!tga) {
     printf("TargaImage: File Open Error\n");
-    exit(0);
+    return false;
   }
   writeheader(tga, bpp);
   if(header.bpp == 32)
     fwrite(frame,4,_width*_height,tga);
   else {
-    long *lp = frame;
+    int *lp = frame;
     for(int i=0; i< _width * _height; i++)
       fwrite(lp++,1,3,tga);
     
   }
-  fclose(tga);
+  return fclose(tga) == 0;
 }
 
 void TargaImage::writeheader(FILE *tga, int bpp) {
@@ -199,7 +224,7 @@ void TargaImage::writeheader(FILE *tga, int bpp) {
   fputc(header.misc, tga);
 }//end writeHeader
 
-void TargaImage::readheader(FILE *tga) {
+bool TargaImage::readheader(FILE *tga) {
 
   int hi, lo;
   header.id_len   = (char)fgetc(tga);
@@ -227,6 +252,9 @@ void TargaImage::readheader(FILE *tga) {
   //Check image type. We only handle uncompressed True Color images. 
   if(header.img_type != 2 && header.img_type != 10)     ok = 0;
   if(header.bpp != 32 && header.bpp != 24)              ok = 0; 
+
+  //and only images of the size we expect
+  if(header.width != _width || header.height != _height) ok = 0;
   if(!ok) {
     printf("TargaImage: Can't handle %s\n",filename); 
     printf("id_len = %d\n",header.id_len);
@@ -238,8 +266,8 @@ void TargaImage::readheader(FILE *tga) {
     printf("x = %d, y = %d\n",header.x, header.y);
     printf("width = %d, height = %d\n",header.width, header.height);
     printf("bpp = %d, misc = %x\n",header.bpp, header.misc);
-    exit(0);
   }
+  return ok;
 }//end readHeader
 
 void TargaImage::displayHeader() {
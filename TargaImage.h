@@ -1,27 +1,38 @@
 //TargaImage.h - class used to create TARGA files or read TARGA files
+#ifndef TARGAIMAGE_H
+#define TARGAIMAGE_H
 #include <stdio.h>
 
+//Pixels are 32-bit 0xAARRGGBB values, row by row from the top.
 class TargaImage {
 public:
 	TargaImage(int Width, int Height);  //Used to create empty TARGA file.
 	TargaImage(char *filename, int width, int height); //Used to read file.
+	TargaImage(int Width, int Height, int *buffer);    //Uses caller's memory.
+	~TargaImage();
     
 	void  displayHeader();
-	long *getFrame();
-	void  fillBox(int top, int bottom, int left, int right, long color);
-	void  writeFile(char *filename, int bpp = 32);
+	int  *getFrame();
+	bool  isValid() {return valid;}    //false if the file couldn't be read
+	bool  isComplete() {return complete;}  //false if it ended before the image
+	bool  read(const char *filename);  //replace the frame with a file's image
+	void  fillBox(int top, int bottom, int left, int right, int color);
+	bool  writeFile(char *filename, int bpp = 32);
 
 private:
-	long *frame;
+	int  *frame;
+	bool  ownFrame;                    //false if the caller supplied it
 	int _width, _height;
 	FILE *tga;
-	char filename[100];
+	char filename[256];
 	bool overwriteOK;
+	bool valid;
+	bool complete;
 
 	void writeheader(FILE *, int bpp = 32);
-	void readheader(FILE *);
+	bool readheader(FILE *);
 	void decodeRLE(FILE *);
-	void decode(FILE *);
+	bool decode(FILE *);
 
 	struct {      //Targa header format.
 		char id_len;
@@ -38,3 +49,5 @@ private:
 		char misc;
 	} header;
 };
+
+#endif // TARGAIMAGE_H
@@ -0,0 +1,109 @@
+//Trace.cpp - records pipeline spans and writes them as Chrome trace events
+
+/*Copyright (c) 2020, Frank J. LoPinto
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.*/
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "Trace.h"
+
+Trace::Trace(const char *Process, const char *fname, int Capacity) {
+    process  = Process;
+
+    //The program may change directory before it writes the trace
+    filename[0] = 0;
+    if(fname[0] != '/' && getcwd(filename, sizeof(filename) - 256))
+        strcat(filename, "/");
+    strncat(filename, fname, 255);
+
+    capacity = Capacity;
+    spans    = new TraceSpan[capacity];
+    count    = 0;
+    frame    = 0;
+    pid      = getpid();
+    tid      = syscall(SYS_gettid);
+    threadName = NULL;
+    next     = NULL;
+    pthread_mutex_init(&lock, NULL);
+}
+
+Trace::~Trace() {
+    delete next;
+    delete [] spans;
+    pthread_mutex_destroy(&lock);
+}
+
+Trace *Trace::addThread(const char *name) {
+    Trace *t = new Trace(process, filename, capacity);
+    t->threadName = name;
+
+    pthread_mutex_lock(&lock);
+    t->next = next;
+    next = t;
+    pthread_mutex_unlock(&lock);
+    return t;
+}
+
+bool Trace::write() {
+
+    //Write a new file and rename it into place, so a reader never sees
+    //half of one
+    char tmp[sizeof(filename) + 4];
+    sprintf(tmp, "%s.tmp", filename);
+    FILE *fp = fopen(tmp, "w");
+    if(!fp) {
+        perror(tmp);
+        return false;
+    }
+
+    //Complete ("X") events, oldest first, with times in microseconds
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"%s\"}}",
+            pid, process);
+    pthread_mutex_lock(&lock);
+    for(Trace *t = this; t; t = t->next) t->writeSpans(fp);
+    pthread_mutex_unlock(&lock);
+    fprintf(fp, "\n]}\n");
+
+    if(fclose(fp) != 0 || rename(tmp, filename) != 0) {
+        perror(filename);
+        return false;
+    }
+    return true;
+}
+
+void Trace::writeSpans(FILE *fp) {
+    if(threadName)
+        fprintf(fp, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+                "\"args\":{\"name\":\"%s\"}}", pid, tid, threadName);
+
+    unsigned long n = __atomic_load_n(&count, __ATOMIC_ACQUIRE);
+    unsigned long first = n > (unsigned long)capacity ? n - capacity : 0;
+    for(unsigned long i=first; i<n; i++) {
+        TraceSpan *s = &spans[i % capacity];
+        fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"pxit\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                "\"pid\":%d,\"tid\":%d,\"args\":{\"frame\":%lu}}",
+                s->name, s->start/1000.0, (s->end - s->start)/1000.0, pid, tid, s->frame);
+    }
+}
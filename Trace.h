@@ -0,0 +1,66 @@
+//Trace.h - per-frame spans of the decoding pipeline, for chrome://tracing
+#ifndef TRACE_H
+#define TRACE_H
+#include <pthread.h>
+#include <stdio.h>
+
+/* Metrics give averages and histograms; a Trace shows what happened to each
+ * frame.  Every stage of the pipeline (dequeue, convert, classify, pack,
+ * verify, write, requeue...) records a span: its name, its start and end on
+ * the Metrics clock, and the number of the frame it worked on.  Spans go
+ * into a fixed ring, so tracing never allocates and only the most recent
+ * ones are kept.
+ *
+ * write() saves them to the file named when the Trace was created (relative
+ * to the directory it was created in) in the Chrome trace-event format
+ * (JSON), which chrome://tracing and ui.perfetto.dev display as a
+ * timeline.  A frame that blew its 33 ms budget shows up as a long "frame"
+ * span, with the stage responsible inside it.
+ *
+ * A Trace isn't locked.  Each thread that records spans needs its own, and
+ * the spans are shown on the thread that created it.  A thread gets one
+ * that is written to the same file with addThread().  Spans recorded while
+ * write() runs may be left out.
+ */
+
+struct TraceSpan {
+    const char    *name;            //a string constant
+    long long      start;           //Metrics::now()
+    long long      end;
+    unsigned long  frame;
+};
+
+class Trace {
+public:
+    Trace(const char *process, const char *fname, int capacity = 65536);
+    ~Trace();
+
+    Trace *addThread(const char *name);  //a Trace for the calling thread
+
+    void nextFrame() {frame++;}
+    void span(const char *name, long long start, long long end) {
+        TraceSpan *s = &spans[count % capacity];
+        s->name  = name;
+        s->start = start;
+        s->end   = end;
+        s->frame = frame;
+        __atomic_store_n(&count, count + 1, __ATOMIC_RELEASE);  //publish it
+    }
+    bool write();
+
+private:
+    const char    *process;
+    char           filename[4096];
+    TraceSpan     *spans;
+    int            capacity;
+    unsigned long  count;           //spans recorded, including overwritten ones
+    unsigned long  frame;
+    int            pid, tid;
+    const char    *threadName;      //NULL for the thread that made the first
+    Trace         *next;            //other threads' Traces, from addThread()
+    pthread_mutex_t lock;           //held while adding one
+
+    void writeSpans(FILE *fp);
+};
+
+#endif // TRACE_H
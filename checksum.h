@@ -3,20 +3,42 @@
 
 const int MAXMSG = 4000;  //What should this value be?
 
+//Check bytes can be offset by a tag so that one pass over a packet also
+//tells which header format it was built with.
+const int tagNone      = 0;	//original 5-byte header
+const int tagExtended  = 1;	//extended header with transfer id
+const int tagIntegrity = 2;	//integrity header, CRC32C instead of the remainder
+const int tagDelta     = 3;	//delta header, CRC32C xor "DLTA"
+const int nTags        = 4;
+
+//Packets with the integrity header are checked with CRC32C (Castagnoli),
+//done by the SSE4.2 crc32 instruction where the CPU has it, and carry a
+//hash of the whole file.  The file hash is the sum of blockHash() over
+//all of the file's blocks, so a receiver can add blocks up in whatever
+//order they arrive.
+
 class CheckSum {
 public:
 	CheckSum(int pktSize);
-	void compute(unsigned char *pkt, const int pktLen);
+	void compute(unsigned char *pkt, const int pktLen, int tag = tagNone);
 	bool verify (const unsigned char *pkt, int pktLen);
+	int  identify(const unsigned char *pkt, int pktLen);	//tag, or -1 if bad
+
+	static unsigned int crc32c(const unsigned char *buf, int len);
+	static unsigned long long blockHash(int sequence, const unsigned char *buf, int len);
 
 	void PrintTables(const char *txt);
 	
 protected:
 	unsigned char p[4];				//Represents p(x) without the leading x**4 term
 	unsigned char alpha[255];	    //Elements of GF8 expressed as powers of alpha.
-	unsigned char alphaLog[255];	//Logarithms to the base alpha of 8-bit numbers.
+	unsigned char alphaLog[256];	//Logarithms to the base alpha of 8-bit numbers.
 	unsigned char *buffer;
-	unsigned char lut[255][4];
+	unsigned char lut[256][4];
+	static const unsigned char tags[tagIntegrity][4];
+	static const unsigned int  crcDeltaTag;
+
+	void remainder(int pktLen);
 
 	unsigned char  add(const unsigned char a, const unsigned char b);
 	unsigned char mult(const unsigned char a, const unsigned char b);
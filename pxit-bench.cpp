@@ -0,0 +1,283 @@
+//pxit-bench - sends a file through a simulated channel and measures goodput
+
+/*Copyright (c) 2020, Frank J. LoPinto
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.*/
+
+/* pxit-bench measures end-to-end throughput without any video hardware.
+ * Frames are rendered from an input file with the encoder, passed through
+ * a simulated broadcast channel (see Channel.h) and handed to an
+ * ImageProcessor, exactly as pxit-capture would.  The file is sent in a
+ * loop, each frame shown for -r video frames, until the decoder has it all
+ * or -p passes have gone by.
+ *
+ * It reports goodput (bytes of the file per second of video) and the CPU
+ * time spent decoding, so changes to the encoder, decoder or the format
+ * can be compared against the same channel.  The received file is checked
+ * against the input.
+ *
+ * The decoder's output goes to a temporary directory that is removed
+ * afterwards unless -k is given.
+ *
+ * pxit-bench is used for testing.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <time.h>
+#include "Channel.h"
+#include "Encoder.h"
+#include "ImageProcessor.h"
+
+double cpuTime();
+bool checkOutput(const unsigned char *data, long length);
+void removeOutput(const char *dir);
+
+int main(int argc, char *argv[]){
+
+    //Defaults describe a perfect channel
+    ChannelParms parms;
+    memset(&parms, 0, sizeof(parms));
+    parms.seed = 1;
+    bool fiducials = false, extended = true, integrity = false, banded = false, keep = false;
+    int palette = paletteStandard;
+    int repeat = 1, passes = 3;
+    double fps = 29.97;
+
+    int opt;
+    while((opt = getopt(argc, argv, "b:BCc:d:D:fF:i:kln:op:r:s:xy")) != -1) {
+        switch(opt) {
+            case 'C': integrity = extended = true; break;
+            case 'b': parms.blur = atof(optarg); break;
+            case 'B': banded = true; break;
+            case 'c': 
+                if(sscanf(optarg, "%d,%d,%d", &parms.shift[0], &parms.shift[1],
+                          &parms.shift[2]) != 3) argc = 0;
+                break;
+            case 'd': parms.dropRate = atof(optarg); break;
+            case 'D': 
+                if(sscanf(optarg, "%lf,%d", &parms.damageRate, &parms.damageRows) != 2 ||
+                   parms.damageRows < 0 || parms.damageRows > height) argc = 0;
+                break;
+            case 'f': fiducials = true; break;
+            case 'F': fps = atof(optarg); break;
+            case 'i': parms.interlace = atof(optarg); break;
+            case 'k': keep = true; break;
+            case 'l': palette = paletteLuma; break;
+            case 'n': parms.noise = atof(optarg); break;
+            case 'o': extended = false; break;
+            case 'p': passes = atoi(optarg); break;
+            case 'r': repeat = atoi(optarg); break;
+            case 's': parms.seed = atoi(optarg); break;
+            case 'x': extended = true; break;
+            case 'y': parms.chroma420 = true; break;
+            default:  argc = 0;             //force usage message
+        }
+    }
+    if(integrity) extended = true;     //the integrity header extends it
+
+    if(argc == 0 || optind != argc - 1 || repeat < 1 || passes < 1 || fps <= 0) {
+        printf("Usage: %s [options] <input file>\n",argv[0]);
+        printf("  -f        reserve corner cells for alignment fiducials\n");
+        printf("  -o        use the original header (no transfer id, files under 16 MB)\n");
+        printf("  -x        use the extended header (the default)\n");
+        printf("  -C        use the integrity header (file hash, CRC32C)\n");
+        printf("  -l        use the luma palette\n");
+        printf("  -B        divide each frame into bands with a packet in each\n");
+        printf("  -r <n>    show each frame for n video frames (1)\n");
+        printf("  -p <n>    send the file at most n times (3)\n");
+        printf("  -F <fps>  video frame rate (29.97)\n");
+        printf("Channel:\n");
+        printf("  -y        YCbCr 4:2:0 chroma subsampling\n");
+        printf("  -n <sd>   Gaussian noise, in 8-bit levels\n");
+        printf("  -b <sd>   Gaussian blur, in pixels\n");
+        printf("  -c r,g,b  add to the red, green and blue levels\n");
+        printf("  -d <p>    probability that a frame is dropped\n");
+        printf("  -i <p>    probability that the fields of two frames are mixed\n");
+        printf("  -D p,rows probability that a stripe of rows is painted over\n");
+        printf("  -s <n>    random seed (1)\n");
+        printf("  -k        keep the decoder's output directory\n");
+        return 0;
+    }
+    char *input = argv[optind];
+
+    //Read the whole input file
+    FILE *fp = fopen(input, "r");
+    if(fp == NULL) {
+        perror(input);
+        return 0;
+    }
+    fseek(fp, 0L, SEEK_END);
+    long filesize = ftell(fp);
+    rewind(fp);
+    if(filesize <= 0 || (filesize >= (1L << 24) && !extended) || filesize >= (1L << 32)) {
+        printf("%s: %ld bytes is not a size we can send%s\n", input, filesize,
+               extended ? "" : " with -o");
+        return 0;
+    }
+    unsigned char *data = new unsigned char[filesize];
+    if(fread(data, 1, filesize, fp) != (size_t)filesize) {
+        printf("%s: read error\n", input);
+        return 0;
+    }
+    fclose(fp);
+
+    Encoder *encoder = new Encoder(filesize, fiducials, extended,
+                                   Encoder::hash(data, filesize), palette, integrity,
+                                   -1, banded);
+    if(integrity) encoder->setFileHash(encoder->fileHash(data));
+    Channel *channel = new Channel(parms);
+    int blkSize = encoder->getBlockSize();
+    int framesNeeded = encoder->getFramesNeeded();
+    int bands = encoder->getBandsPerFrame();
+
+    //The decoder writes into a scratch directory
+    char outdir[] = "/tmp/pxit-bench-XXXXXX";
+    if(!mkdtemp(outdir) || chdir(outdir) == -1) {
+        perror(outdir);
+        return 0;
+    }
+    ImageProcessor *processor = new ImageProcessor();
+    Metrics *metrics = processor->getMetrics();
+
+    int *clean    = new int[width*height];
+    int *received = new int[width*height];
+
+    printf("\t**********Welcome to pxit-bench**********\n\n");
+    printf("Sending %s: %ld bytes in %d blocks of %d bytes, %d to a frame\n\n",
+           input, filesize, framesNeeded, blkSize, bands);
+
+    long videoFrames = 0, dropped = 0;
+    double renderTime = 0, channelTime = 0, decodeTime = 0;
+    bool complete = false;
+
+    for(int pass=0; pass<passes && !complete; pass++) {
+        for(int seq=0; seq<framesNeeded && !complete; seq+=bands) {
+
+            //A block in each band; bands past the last block repeat it
+            double t0 = cpuTime();
+            for(int b=0; b<bands; b++) {
+                int blk = seq + b < framesNeeded ? seq + b : framesNeeded - 1;
+                long offset = (long)blk*blkSize;
+                int len = filesize - offset < blkSize ? filesize - offset : blkSize;
+                encoder->render(blk, data + offset, len, clean, b);
+            }
+            renderTime += cpuTime() - t0;
+
+            for(int r=0; r<repeat && !complete; r++) {
+                videoFrames++;
+
+                double t1 = cpuTime();
+                bool ok = channel->transmit(clean, received);
+                double t2 = cpuTime();
+                channelTime += t2 - t1;
+                if(!ok) {
+                    dropped++;
+                    continue;
+                }
+
+                processor->processImage(received);
+                decodeTime += cpuTime() - t2;
+                complete = metrics->counters[filesComplete] > 0;
+            }
+        }
+    }
+
+    double seconds = videoFrames / fps;
+    unsigned long frames  = metrics->counters[framesSeen];
+    unsigned long repeats = metrics->counters[framesRepeated];
+    unsigned long idle    = metrics->counters[framesIdle];
+    unsigned long good    = metrics->counters[checksumPass];
+    unsigned long bad     = metrics->counters[checksumFail];
+    unsigned long newBlks = metrics->counters[blocksNew];
+
+    printf("\n");
+    printf("Video frames:     %ld (%.1f s at %.2f fps), %ld dropped\n",
+           videoFrames, seconds, fps, dropped);
+    printf("Skipped:          %lu repeats, %lu without a pattern, of %lu frames\n",
+           repeats, idle, frames);
+    printf("Checksums:        %lu passed, %lu failed (%.1f%% good), %lu by combining copies\n",
+           good, bad, good + bad ? 100.0*good/(good + bad) : 0.0,
+           metrics->counters[packetsCombined]);
+    printf("Blocks:           %lu of %d received, %lu duplicates\n",
+           newBlks, framesNeeded, metrics->counters[blocksDuplicate]);
+
+    if(complete) {
+        bool same = checkOutput(data, filesize);
+        printf("File:             complete, %s\n", same ? "matches input" : "DOES NOT MATCH INPUT");
+        printf("Goodput:          %.1f bytes/s of video\n", filesize / seconds);
+    } else {
+        long bytes = newBlks * blkSize;
+        if(bytes > filesize) bytes = filesize;
+        printf("File:             incomplete after %d passes\n", passes);
+        printf("Goodput:          %.1f bytes/s of video (partial)\n", bytes / seconds);
+    }
+
+    printf("Decode CPU:       %.3f s, %.1f us/frame\n",
+           decodeTime, frames ? 1e6*decodeTime/frames : 0.0);
+    printf("Render CPU:       %.3f s, channel CPU: %.3f s\n", renderTime, channelTime);
+
+    delete processor;       //closes the output file
+    if(keep) printf("Output kept in %s\n", outdir);
+    else     removeOutput(outdir);
+    return complete ? 0 : 1;
+}
+
+double cpuTime() {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+bool checkOutput(const unsigned char *data, long length) {
+
+    //The only .7z file in the scratch directory is the one received
+    DIR *dir = opendir(".");
+    struct dirent *entry;
+    bool same = false;
+    while((entry = readdir(dir)) != NULL) {
+        char *ptr = strrchr(entry->d_name, '.');
+        if(!ptr || strcmp(ptr, ".7z")) continue;
+
+        FILE *fp = fopen(entry->d_name, "r");
+        if(!fp) break;
+        unsigned char *buf = new unsigned char[length + 1];
+        same = fread(buf, 1, length + 1, fp) == (size_t)length && !memcmp(buf, data, length);
+        delete [] buf;
+        fclose(fp);
+        break;
+    }
+    closedir(dir);
+    return same;
+}
+
+void removeOutput(const char *outdir) {
+    DIR *dir = opendir(".");
+    struct dirent *entry;
+    while((entry = readdir(dir)) != NULL)
+        if(entry->d_name[0] != '.') unlink(entry->d_name);
+    closedir(dir);
+    chdir("/");
+    rmdir(outdir);
+}
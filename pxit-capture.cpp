@@ -31,10 +31,14 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.*/
 #include <libv4l2.h>
 #include <libv4lconvert.h>
 #include <dirent.h>
+#include <poll.h>
 #include <pthread.h>
+#include <signal.h>
 #include "ImageProcessor.h"
+#include "Metrics.h"
 #include "TargaImage.h"
 #include <errno.h>
+#include <unistd.h>
 
 //Macros
 #define CLEAR(x) memset(&(x), 0, sizeof(x))
@@ -42,30 +46,121 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.*/
 //Constants
 const int verbose = 0;  //produce verbose output
 
+//Options
+char *outputDir   = NULL;   //where received files are written
+MetricsExporter *exporter = NULL;   //-M: export metrics to a file
+double presence = presenceFraction; //-p: fraction of presence samples that must match
+PacketJournal *journal = NULL;      //-J: record verified packets
+char *bases[maxBases];              //-b: previous versions for deltas
+int   nbases = 0;
+Trace *trace = NULL;                //-T: record the stages of each frame
+
+//Each input (-i) is read and decoded on its own thread, and they all
+//store packets through one shared ImageProcessor
+struct Input {
+    const char     *path;           //V4L2 device or file of raw frames
+    ImageProcessor *processor;      //decodes this input's frames
+    Trace          *trace;
+    pthread_t       thread;
+    volatile bool   done;           //the thread has finished
+};
+const int maxInputs = 8;
+Input inputs[maxInputs];
+int   ninputs = 0;
+
+//Set by signal handlers and acted on in the processing loop
+volatile sig_atomic_t reportRequested = 0;  //SIGUSR1: write a missing-block report
+volatile sig_atomic_t stopRequested   = 0;  //SIGINT, SIGTERM: write the report and exit
+
 //Function prototypes
-int  initializeDevice(int *nBuffers);        //Returns file descriptor to capture device. The number
+int  initializeDevice(const char *path, int *nBuffers); //Returns file descriptor to capture device. The number
                                             //of frame buffers available in the hardware RAM is returned.
+void *captureInput(void *input);            //Thread that reads and decodes an input
+void captureDevice(Input *in);
+void replayFile(Input *in);
+void decodeFrame(Input *in, u_char *yuv, int *frame, TargaImage *tga);
+void exportMetrics(ImageProcessor *combiner);
                                             
 void showSamplePoints(int *frame);          //Create an image indicating sample points
 int  validateInputs(int argc, char **argv); //Make sure we have a valid directory to write into
 void yuv2rgb(u_char *buf, int *frame);      //Convert from YUV to RGB color spaces.
+void yuv2rgbSamples(u_char *buf, int *frame, const int *offsets, int n);  //only some pixels
+int  yuv2rgbPixel(u_char *buf, int z);
+void onSignal(int sig);                     //Record signals for the processing loop
+
+void onSignal(int sig) {
+    if(sig == SIGUSR1) reportRequested = 1;
+    else               stopRequested   = 1;
+}
 
 int validateInputs(int argc, char **argv) {
-    if(argc != 2) {
-        printf("Usage: %s <path to output directory>\n",argv[0]);
+    int opt;
+    const char *journalName = NULL;
+    unsigned int source = 0;
+    while((opt = getopt(argc, argv, "b:i:J:M:p:S:T:")) != -1) {
+        switch(opt) {
+            case 'i':
+                //Keep the full path, we're about to change directory
+                if(ninputs == maxInputs) {
+                    printf("Too many inputs, at most %d\n", maxInputs);
+                    return 0;
+                }
+                if(!(inputs[ninputs++].path = realpath(optarg, NULL))) {
+                    perror(optarg);
+                    return 0;
+                }
+                break;
+            case 'T': trace = new Trace("pxit-capture", optarg); break;
+            case 'b':
+                //Keep the full path, we're about to change directory
+                if(nbases == maxBases) {
+                    printf("Too many previous versions, at most %d\n", maxBases);
+                    return 0;
+                }
+                if(!(bases[nbases++] = realpath(optarg, NULL))) {
+                    perror(optarg);
+                    return 0;
+                }
+                break;
+            case 'J': journalName = optarg; break;
+            case 'M': exporter = new MetricsExporter(optarg); break;
+            case 'p': presence = atof(optarg); break;
+            case 'S': source = strtoul(optarg, NULL, 0); break;
+            default:  argc = 0;             //force usage message
+        }
+    }
+
+    if(argc == 0 || optind != argc - 1) {
+        printf("Usage: %s [-i <device or replay file>]... [-M <metrics file>] [-p <fraction>] [-J <journal> [-S <source id>]] [-b <previous version>]... [-T <trace file>] <path to output directory>\n",argv[0]);
+        printf("  -i  capture device (/dev/video0), or a file of frames as it delivers\n");
+        printf("      them (YUYV); several inputs combine into one reception\n");
+        printf("  -M  write decoder metrics to a file in Prometheus text format\n");
+        printf("  -p  fraction of sample cells that must show palette colors before\n");
+        printf("      a frame is decoded (%.1f); lower misses fewer frames, 0 decodes all\n",
+               presenceFraction);
+        printf("  -J  append verified packets to a journal for pxit-merge\n");
+        printf("  -S  source id recorded in the journal (0)\n");
+        printf("  -b  a previous version of a file that deltas apply to\n");
+        printf("  -T  trace the stages of each frame; written as Chrome trace events\n");
+        printf("      on SIGUSR1 and at exit\n");
         return 0;
     } 
+    outputDir = argv[optind];
+    if(ninputs == 0) inputs[ninputs++].path = "/dev/video0";
+
+    //The journal is named relative to where we started
+    if(journalName && !(journal = PacketJournal::open(journalName, source))) return 0;
 
    //Can we access the directory?
     DIR *dir;
-    if ((dir = opendir (argv[1])) == NULL) {
-        printf("Unable to open directory %s\n",argv[1]);
+    if ((dir = opendir (outputDir)) == NULL) {
+        printf("Unable to open directory %s\n",outputDir);
         return 0;
     }
     
     //Can we change the working directory?
-    if(chdir(argv[1]) == -1) { //change working directory   
-        printf("Unable to change directory to %s\n",argv[1]);
+    if(chdir(outputDir) == -1) { //change working directory   
+        printf("Unable to change directory to %s\n",outputDir);
         perror("chdir");
         return 0;
     }
@@ -74,7 +169,7 @@ int validateInputs(int argc, char **argv) {
     return 1;    
 }
 
-int initializeDevice(int *nbuffers) {
+int initializeDevice(const char *path, int *nbuffers) {
     struct v4l2_capability cap;             //capture device capabilities 
     struct v4l2_format format;              //specify video stream format
     struct v4l2_requestbuffers bufrequest;   //ask for device-based buffer
@@ -82,8 +177,8 @@ int initializeDevice(int *nbuffers) {
         
     //Open the video capture device
     int fd;
-    if((fd = open("/dev/video0", O_RDWR)) < 0){
-        perror("open");
+    if((fd = open(path, O_RDWR | O_NONBLOCK)) < 0){
+        perror(path);
         printf("Check video device.\n");
         return -1;
     }
@@ -165,29 +260,122 @@ int main(int argc, char *argv[]) {
     
     //Validate input directory and change to it if possible.
     if(!validateInputs(argc, argv)) return -1;
-    
-    //Initalize capture device.  Returns file descriptor to capture device.
-    int nbuffers;
-    int fd = initializeDevice(&nbuffers);
-    if(fd <=0) return -1;  //initializeDevice failed
-
 
     printf("\t******Welcome to pxit-capture*******\n\n");  
-    printf("Using %d RAM buffers on capture device\n",nbuffers);
-    printf("Writing received files to %s\n",argv[1]);
-    
+    printf("Writing received files to %s\n",outputDir);
+    printf("Send SIGUSR1 for a report of missing blocks\n");
+
+    //Signals go to this thread only.  The capture threads start with them
+    //blocked and notice stopRequested within a second.
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    //The shared processor keeps the files.  A block received on any input
+    //counts, so a file is complete when the inputs together have all of it.
+    ImageProcessor *combiner = new ImageProcessor();
+    combiner->setJournal(journal);
+
+    //It stores packets for every input, but one at a time under its lock,
+    //so its spans (write, base, finish, save) can share a Trace, shown as
+    //the "store" thread.
+    if(trace) combiner->setTrace(trace->addThread("store"));
+    for(int i=0; i<nbases; i++)
+        if(!combiner->addBase(bases[i])) return -1;
+
+    //Each input is read and decoded on its own thread
+    for(int i=0; i<ninputs; i++) {
+        inputs[i].processor = new ImageProcessor();
+        inputs[i].processor->setPresence(presence);
+        inputs[i].processor->setCombiner(combiner);
+        inputs[i].done = false;
+        if(pthread_create(&inputs[i].thread, NULL, captureInput, &inputs[i]) != 0) {
+            perror("pthread_create");
+            return -1;
+        }
+    }
+
+    //No SA_RESTART, so a signal interrupts the wait below
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = onSignal;
+    sigaction(SIGUSR1, &action, NULL);
+    sigaction(SIGINT,  &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    pthread_sigmask(SIG_UNBLOCK, &signals, NULL);
+
+    /* *****************************************************/
+    /*              ENTER SUPERVISION LOOP                 */
+    /* *****************************************************/
+    for(;;) {
+
+        //Save the list of missing blocks (and the trace) when asked, and
+        //before exiting
+        if(reportRequested || stopRequested) {
+            reportRequested = 0;
+            combiner->reportMissing();
+            if(trace) trace->write();
+        }
+        if(stopRequested) break;
+
+        //Replay files come to an end
+        bool running = false;
+        for(int i=0; i<ninputs; i++)
+            if(!inputs[i].done) running = true;
+        if(!running) break;
+
+        if(exporter && exporter->due()) exportMetrics(combiner);
+        poll(NULL, 0, 1000);
+    }
+
+    stopRequested = 1;
+    for(int i=0; i<ninputs; i++) pthread_join(inputs[i].thread, NULL);
+    combiner->reportMissing();
+    combiner->checkpoint();         //resume from here next time
+    if(exporter) exportMetrics(combiner);
+    if(trace) trace->write();
+    return 0;
+}
+
+void exportMetrics(ImageProcessor *combiner) {
 
-  
+    //Frames are counted by the inputs, blocks and files by the combiner
+    Metrics total;
+    total.add(*combiner->getMetrics());
+    for(int i=0; i<ninputs; i++) total.add(*inputs[i].processor->getMetrics());
+    exporter->write(total, combiner->blocksRemaining(), combiner->sessionsActive());
+}
 
+void *captureInput(void *arg) {
+    Input *in = (Input *)arg;
+
+    //A trace shows each input on its own thread
+    in->trace = trace ? trace->addThread(in->path) : NULL;
+    in->processor->setTrace(in->trace);
+
+    struct stat st;
+    if(stat(in->path, &st) == 0 && S_ISREG(st.st_mode)) replayFile(in);
+    else                                                captureDevice(in);
+    in->done = true;
+    return NULL;
+}
+
+void captureDevice(Input *in) {
+
+    //Initalize capture device.  Returns file descriptor to capture device.
+    int nbuffers;
+    int fd = initializeDevice(in->path, &nbuffers);
+    if(fd <=0) return;  //initializeDevice failed
+    printf("%s: using %d RAM buffers on capture device\n", in->path, nbuffers);
 
    //Note: 'frame' is a pointer to RAM within the a
     //      TargaImage object.  This makes it easy to
     //      take snapshots for diagnostic purposes.
     TargaImage *tga = new TargaImage(720,480);  //useful for debugging
     int *frame = (int *)tga->getFrame();  //use memory from TARGA object
-    
-    //This analyzes captured images.
-    ImageProcessor *processor = new ImageProcessor();  
 
     //These are memory-mapped addresses of the device-resident RAM
     struct ram_t {                            
@@ -210,7 +398,7 @@ int main(int argc, char *argv[]) {
         
         if(ioctl(fd, VIDIOC_QUERYBUF, &buffer) < 0){
             perror("VIDIOC_QUERYBUF");
-            exit(1);
+            return;
         }
         
         //Use the information returned to create a memory
@@ -226,7 +414,7 @@ int main(int argc, char *argv[]) {
         
         if(buffer_start == MAP_FAILED){
             perror("mmap");
-            return 0;
+            return;
         }
         
         //Now save the starting userspace address of buffer
@@ -235,7 +423,7 @@ int main(int argc, char *argv[]) {
         
         if(ioctl(fd, VIDIOC_QBUF, &buffer) < 0){
             perror("VIDIOC_QBUF");
-            return 0;
+            return;
         }  
     }
     
@@ -243,51 +431,115 @@ int main(int argc, char *argv[]) {
     int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     if(ioctl(fd, VIDIOC_STREAMON, &type) < 0){
         perror("VIDIOC_STREAMON");
-        return 0;
+        return;
     }
     
 
     /* *****************************************************/
     /*              ENTER PROCESSING LOOP                  */
     /* *****************************************************/
-    int cycle=0;
-    while(1) {
-        
-        //Dequeue a buffer filled by the V4L driver
+    while(!stopRequested) {
+
+        //Wait for a buffer filled by the V4L driver, waking up now and then
+        //to see whether we should stop
+        long long tf = Metrics::now();
+        struct pollfd pfd = {fd, POLLIN, 0};
+        if(poll(&pfd, 1, 1000) <= 0) continue;
+
+        //Dequeue it
         if(ioctl(fd, VIDIOC_DQBUF, &buffer) < 0){
+            if(errno == EINTR || errno == EAGAIN) continue;
             perror("VIDIOC_DQBUF");
-            return -1;
+            return;
         }
-      
-        //Do a color space transformation on the device-resident
-        //image and write the RGB version to 'frame'.
-        yuv2rgb((u_char *)memoryMapInfo[cycle].start,frame);
-        
-        //Let the image processor examine the frame.
-        int rtn = processor->processImage(frame);
-        
-        if(rtn == -1) { 
-            if(verbose) {
-                printf("Checksum failed after first good one\n");
-                showSamplePoints(frame);
-                char filename[100];
-                strcpy(filename,argv[1]);
-                strcat(filename,"-failedFrame.tga");
-                tga->writeFile(filename);
-                printf("Dumped failing image to %s\n",filename);
-                return 0;  //We have to stop.  Depending on the vide source
-                           //there may be nothing but bad checksums from here on.
-            }
+        long long td = Metrics::now();
+        if(in->trace) {
+            in->trace->nextFrame();
+            in->trace->span("dequeue", tf, td);
         }
-        
+
+        decodeFrame(in, (u_char *)memoryMapInfo[buffer.index].start, frame, tga);
+
         //Return the buffer to the driver.
+        long long t0 = Metrics::now();
         if(ioctl(fd, VIDIOC_QBUF, &buffer) < 0){  
             perror("VIDIOC_QBUF");
-            return 0;
+            return;
         } 
 
-        //Cycle through the buffers
-        if(++cycle >= nbuffers) cycle=0;  
+        //The work on a frame, from dequeue to requeue, has to fit in 33 ms
+        if(in->trace) {
+            long long t1 = Metrics::now();
+            in->trace->span("requeue", t0, t1);
+            in->trace->span("frame", td, t1);
+        }
+    }
+    ioctl(fd, VIDIOC_STREAMOFF, &type);
+}
+
+void replayFile(Input *in) {
+
+    //A replay file holds frames as the device delivers them, YUYV 4:2:2,
+    //one after another (e.g. v4l2-ctl --stream-mmap --stream-to=<file>)
+    FILE *fp = fopen(in->path, "rb");
+    if(!fp) {
+        perror(in->path);
+        return;
+    }
+    TargaImage *tga = new TargaImage(720,480);
+    int *frame = (int *)tga->getFrame();
+    u_char *yuv = new u_char[width*height*2];
+
+    int n = 0;
+    while(!stopRequested) {
+        long long tf = Metrics::now();
+        if(fread(yuv, 1, width*height*2, fp) != (size_t)width*height*2) break;
+        long long td = Metrics::now();
+        if(in->trace) {
+            in->trace->nextFrame();
+            in->trace->span("read", tf, td);
+        }
+
+        decodeFrame(in, yuv, frame, tga);
+        if(in->trace) in->trace->span("frame", td, Metrics::now());
+        n++;
+    }
+    printf("%s: replayed %d frames\n", in->path, n);
+    delete [] yuv;
+    delete tga;
+    fclose(fp);
+}
+
+void decodeFrame(Input *in, u_char *yuv, int *frame, TargaImage *tga) {
+    ImageProcessor *processor = in->processor;
+    Metrics *metrics = processor->getMetrics();
+
+    //Do a color space transformation on the device-resident
+    //image and write the RGB version to 'frame'.  Between transfers
+    //only the few pixels the presence detector looks at are converted;
+    //processImage() then passes over the frame without decoding it.
+    long long t0 = Metrics::now();
+    yuv2rgbSamples(yuv, frame, processor->getPresenceOffsets(), presenceSamples);
+    if(processor->detect(frame)) yuv2rgb(yuv, frame);
+    long long t1 = Metrics::now();
+    metrics->timeStage(stageInput, t1 - t0);
+    if(in->trace) in->trace->span("convert", t0, t1);
+    
+    //Let the image processor examine the frame.
+    int rtn = processor->processImage(frame);
+    
+    if(rtn == -1) { 
+        if(verbose) {
+            printf("Checksum failed after first good one\n");
+            showSamplePoints(frame);
+            char filename[100];
+            strcpy(filename,outputDir);
+            strcat(filename,"-failedFrame.tga");
+            tga->writeFile(filename);
+            printf("Dumped failing image to %s\n",filename);
+            stopRequested = 1;  //We have to stop.  Depending on the vide source
+                                //there may be nothing but bad checksums from here on.
+        }
     }
 }
 
@@ -297,49 +549,55 @@ int main(int argc, char *argv[]) {
  */
  
 void yuv2rgb(u_char *yuv, int *rgb) {
-    int Y, U, V;            
 
     //Loop over every pixel in the image (though we don't have to)
     for(int row=0;row<height;row++) {
         for(int col=0;col<width;col++) {
-            
             int z = row*width + col;                     //pixel number
+            *(rgb + z) = yuv2rgbPixel(yuv, z);
+        }
+    }
+}
+
+void yuv2rgbSamples(u_char *yuv, int *rgb, const int *offsets, int n) {
+    for(int i=0;i<n;i++) rgb[offsets[i]] = yuv2rgbPixel(yuv, offsets[i]);
+}
+
+int yuv2rgbPixel(u_char *yuv, int z) {
+    int Y, U, V;            
             
-            u_char  *yptr = (u_char *)yuv + (2 * z);     //pointer to luminance 
-            
-            Y = *yptr;							               //Luminance value
-            
-            //Compute u and v values for every pixel in the image
-            if (z & 1) { 
-                U = *(yptr - 1);    //U and V values surround the luminance value for odd numbered pixels.
-                V = *(yptr + 1);
-            } else {                //U and V values follow the luminance value for even numbered pixels.
-                U = *(yptr + 1);
-                V = *(yptr + 3);
-            }
-
-            int C = Y - 16;
-            int D = U - 128;
-            int E = V - 128;
-
-            int R = (298 * C + 409 * E + 128) >> 8;
-            int G = (298 * C - 100 * D - 208 * E + 128) >> 8;
-            int B = (298 * C + 516 * D + 128) >> 8;
-
-            //Enforce bounds on color intensity
-            if (R > 255) R = 255; else if (R < 0) R = 0;
-            if (G > 255) G = 255; else if (G < 0) G = 0;
-            if (B > 255) B = 255; else if (B < 0) B = 0;
+    u_char  *yptr = (u_char *)yuv + (2 * z);     //pointer to luminance 
             
-            //Now copy these RGB components into rgb
-            int color = 0xFF;   color <<= 8; //alpha (transparency)
-            color |= R;         color <<= 8; //red
-            color |= G;         color <<= 8; //greem
-            color |= B;                      //blue
+    Y = *yptr;							               //Luminance value
             
-            *(rgb + z) = color;
-        }
+    //Compute u and v values for every pixel in the image
+    if (z & 1) { 
+        U = *(yptr - 1);    //U and V values surround the luminance value for odd numbered pixels.
+        V = *(yptr + 1);
+    } else {                //U and V values follow the luminance value for even numbered pixels.
+        U = *(yptr + 1);
+        V = *(yptr + 3);
     }
+
+    int C = Y - 16;
+    int D = U - 128;
+    int E = V - 128;
+
+    int R = (298 * C + 409 * E + 128) >> 8;
+    int G = (298 * C - 100 * D - 208 * E + 128) >> 8;
+    int B = (298 * C + 516 * D + 128) >> 8;
+
+    //Enforce bounds on color intensity
+    if (R > 255) R = 255; else if (R < 0) R = 0;
+    if (G > 255) G = 255; else if (G < 0) G = 0;
+    if (B > 255) B = 255; else if (B < 0) B = 0;
+            
+    //Now copy these RGB components into rgb
+    int color = 0xFF;   color <<= 8; //alpha (transparency)
+    color |= R;         color <<= 8; //red
+    color |= G;         color <<= 8; //greem
+    color |= B;                      //blue
+    return color;
 }
 
 void showSamplePoints(int *frame) {
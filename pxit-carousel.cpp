@@ -0,0 +1,257 @@
+//pxit-carousel - interleaves files into one repeating broadcast stream
+
+/*Copyright (c) 2020, Frank J. LoPinto
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.*/
+
+/* pxit-carousel builds one continuous video stream that broadcasts a set of
+ * files over and over, to fill a slot of a given length.
+ *
+ * Each file is given as <path>[:<priority>[:<repeats>]].  Frames of the
+ * files are interleaved in proportion to their priorities (default 1), so
+ * a small urgent file can go out several times while a large one goes out
+ * once.  A file stays in the schedule until it has been sent <repeats>
+ * times (default 1).  When every file has met its target, all of them are
+ * scheduled again until the slot is full.  If the slot is too short for
+ * the targets, the shortfall is reported.
+ *
+ * Every file is sent with the extended header, so the receiver can tell
+ * the interleaved files apart, or with the integrity header (-C), which
+ * also lets the receiver check each finished file against its hash.
+ * Rendered frames are kept in a cache of -c megabytes, so later passes
+ * over the same files only cost output I/O.  Frames beyond what the cache
+ * holds are rendered again on every pass.
+ *
+ * The output is a YUV4MPEG2 stream at 29.97 frames per second, each data
+ * frame shown for -r video frames.
+ *
+ * pxit-carousel is used for production.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "Encoder.h"
+#include "FrameCache.h"
+
+//A file in the carousel
+struct Carousel {
+    char         *path;
+    FILE         *fp;
+    long          filesize;
+    Encoder      *encoder;
+    int           priority;
+    int           repeats;          //times the whole file should be sent
+    int           next;             //next block to send
+    int           passes;           //times the whole file has been sent
+    long          credit;           //for weighted round robin
+};
+
+const int frameBytes = width*height*3/2;    //YCbCr 4:2:0
+
+int  pickNext(Carousel *files, int nfiles, bool all);
+
+int main(int argc, char *argv[]){
+
+    bool fiducials = false;
+    bool integrity = false;
+    int palette = paletteStandard;
+    int repeat = 1;
+    long long cacheMB = 256;
+    double slot = 0;
+    char *output = NULL;
+
+    int opt;
+    while((opt = getopt(argc, argv, "Cc:flo:r:s:")) != -1) {
+        switch(opt) {
+            case 'C': integrity = true; break;
+            case 'c': cacheMB = atoll(optarg); break;
+            case 'f': fiducials = true; break;
+            case 'l': palette = paletteLuma; break;
+            case 'o': output = optarg; break;
+            case 'r': repeat = atoi(optarg); break;
+            case 's': slot = atof(optarg); break;
+            default:  argc = 0;             //force usage message
+        }
+    }
+
+    if(argc == 0 || optind == argc || !output || slot*30000/1001 < repeat || repeat < 1 ||
+       cacheMB < 1) {
+        printf("\tUsage: %s -o <output.y4m> -s <seconds> [options] <file>[:<priority>[:<repeats>]] ...\n",argv[0]);
+        printf("\t  -o  output stream (YUV4MPEG2)\n");
+        printf("\t  -s  length of the broadcast slot in seconds\n");
+        printf("\t  -r  show each frame for n video frames (1)\n");
+        printf("\t  -c  frame cache size in megabytes (256)\n");
+        printf("\t  -f  reserve corner cells for alignment fiducials\n");
+        printf("\t  -l  use the luma palette\n");
+        printf("\t  -C  send a hash of each file and check frames with CRC32C\n");
+        return 0;
+    }
+
+    printf("\t**********Welcome to pxit-carousel**********\n\n");  
+
+    //Open the files and set up an encoder for each
+    int nfiles = argc - optind;
+    Carousel *files = new Carousel[nfiles];
+    for(int i=0;i<nfiles;i++) {
+        Carousel *c = &files[i];
+        c->path = argv[optind + i];
+        c->priority = 1;
+        c->repeats = 1;
+
+        //priority and repeats follow the last '/'
+        char *slash = strrchr(c->path, '/');
+        char *colon = strchr(slash ? slash : c->path, ':');
+        if(colon) {
+            *colon = 0;
+            if(sscanf(colon+1, "%d:%d", &c->priority, &c->repeats) < 1 ||
+               c->priority < 1 || c->repeats < 0) {
+                printf("\tBad priority or repeat count for %s\n", c->path);
+                return 0;
+            }
+        }
+
+        c->fp = fopen(c->path, "r");
+        if(!c->fp) {
+            perror(c->path);
+            return 0;
+        }
+        fseek(c->fp, 0L, SEEK_END);
+        c->filesize = ftell(c->fp);
+        rewind(c->fp);
+        if(c->filesize <= 0 || c->filesize >= (1L << 32)) {
+            printf("\t%s: can't send a file of %ld bytes\n", c->path, c->filesize);
+            return 0;
+        }
+
+        c->encoder = new Encoder(c->filesize, fiducials, true, Encoder::hashFile(c->fp), palette,
+                                 integrity);
+        if(integrity)
+            c->encoder->setFileHash(Encoder::hashBlocks(c->fp, c->encoder->getBlockSize()));
+        c->next = c->passes = 0;
+        c->credit = 0;
+        printf("\t%s: %d frames, priority %d, %d repeats\n", c->path,
+               c->encoder->getFramesNeeded(), c->priority, c->repeats);
+    }
+
+    FILE *y4m = fopen(output, "wb");
+    if(!y4m) {
+        perror(output);
+        return 0;
+    }
+    fprintf(y4m, "YUV4MPEG2 W%d H%d F30000:1001 Ip A10:11 C420mpeg2\n", width, height);
+
+    //The slot holds a whole number of video frames
+    long videoFrames = (long)(slot * 30000 / 1001);
+    long dataFrames = videoFrames / repeat;
+    FrameCache *cache = new FrameCache(cacheMB << 20, frameBytes);
+    unsigned char *scratch = new unsigned char[frameBytes];    //for frames not cached
+    unsigned char block[packetSize];
+
+    //Frames that don't fit in the cache are rendered on every pass
+    long framesUsed = 0;
+    for(int i=0;i<nfiles;i++) framesUsed += files[i].encoder->getFramesNeeded();
+    if(framesUsed > dataFrames) framesUsed = dataFrames;
+    if(framesUsed > cache->capacity())
+        printf("	Warning: the schedule has %ld frames but the cache holds %d, "
+               "use -c %lld to hold them all\n", framesUsed, cache->capacity(),
+               (framesUsed*frameBytes >> 20) + 1);
+    bool targetsMet = false;
+    long written = 0;
+
+    for(long n=0; n<dataFrames; n++) {
+
+        //Until every file has been sent as often as asked, only files
+        //short of their target are scheduled
+        if(!targetsMet) {
+            targetsMet = true;
+            for(int i=0;i<nfiles;i++)
+                if(files[i].passes < files[i].repeats) targetsMet = false;
+        }
+        int i = pickNext(files, nfiles, targetsMet);
+        Carousel *c = &files[i];
+        int seq = c->next;
+
+        //Render the frame unless it's cached
+        unsigned long long key = ((unsigned long long)i << 32) | seq;
+        unsigned char *yuv = cache->find(key);
+        if(!yuv) {
+            int blkSize = c->encoder->getBlockSize();
+            fseek(c->fp, (long)seq*blkSize, SEEK_SET);
+            int bytesRead = fread(block, 1, blkSize, c->fp);
+            if(bytesRead < blkSize && !feof(c->fp)) {
+                printf("\t%s: read error\n", c->path);
+                return 0;
+            }
+            yuv = cache->insert(key);
+            if(!yuv) yuv = scratch;
+            c->encoder->renderYUV(seq, block, bytesRead, yuv);
+        }
+
+        //The last frame also fills out the slot
+        int copies = repeat;
+        if(n == dataFrames - 1) copies += videoFrames % repeat;
+        for(int r=0;r<copies;r++) {
+            fprintf(y4m, "FRAME\n");
+            if(fwrite(yuv, 1, frameBytes, y4m) != (size_t)frameBytes) {
+                perror(output);
+                return 0;
+            }
+            written++;
+        }
+
+        if(++c->next == c->encoder->getFramesNeeded()) {
+            c->next = 0;
+            c->passes++;
+        }
+    }
+
+    if(fclose(y4m) != 0) {
+        perror(output);
+        return 0;
+    }
+
+    printf("\n\t%ld video frames (%.1f s) written to %s\n", written,
+           written * 1001 / 30000.0, output);
+    printf("\t%ld frames rendered, %ld taken from the cache\n", cache->misses, cache->hits);
+    for(int i=0;i<nfiles;i++) {
+        Carousel *c = &files[i];
+        printf("\t%s: sent %d times%s\n", c->path, c->passes,
+               c->passes < c->repeats ? ", SHORT OF TARGET" : "");
+    }
+    return 0;
+}
+
+int pickNext(Carousel *files, int nfiles, bool all) {
+
+    //Smooth weighted round robin: every candidate gains its priority, the
+    //one with the most credit goes next and pays back the total.
+    int best = -1, total = 0;
+    for(int i=0;i<nfiles;i++) {
+        if(!all && files[i].passes >= files[i].repeats) continue;
+        files[i].credit += files[i].priority;
+        total += files[i].priority;
+        if(best < 0 || files[i].credit > files[best].credit) best = i;
+    }
+    files[best].credit -= total;
+    return best;
+}
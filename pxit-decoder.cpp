@@ -27,31 +27,130 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.*/
  * an object of type ImageProcessor that analyzes frames, performs checksums,
  * and builds received files.
  * 
- * pxit-decoder is used for debugging.
+ * Watch mode (-w) keeps running after the images already in the directory
+ * have been decoded, and decodes each new image as soon as the program
+ * writing it closes it (or renames it into the directory).  Images can be
+ * deleted (-D) or moved to an archive directory on the same filesystem
+ * (-a) once they have been decoded.  SIGINT or SIGTERM saves the state of
+ * unfinished files and exits; SIGUSR1 writes missing-block reports.
+ * Images found when the program starts may still be being written, so in
+ * watch mode those that end early are left for the watch to pick up when
+ * they are closed.  Every other image is deleted or moved, whether or not
+ * it held a packet.  If the watch's queue overflows, the directory is
+ * scanned again.
+ * 
+ * With -J, every packet that brings a new block is also appended to a
+ * journal (see PacketJournal.h) that pxit-merge can combine with others.
+ * 
+ * With -T, the stages of each frame are traced (see Trace.h) and written
+ * at exit, or on SIGUSR1 in watch mode.
+ * 
+ * A delta (pxit-encoder -d) only carries the blocks that changed.  The
+ * previous version it applies to is given with -b, as many times as there
+ * are versions the deltas might apply to, unless it was received into the
+ * same directory (see pxit-received in ImageProcessor.h).
+ * 
+ * pxit-decoder is used for debugging, and in watch mode to follow a frame
+ * grabber's spool directory.
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/inotify.h>
 #include <fcntl.h>
 #include <string.h>
 #include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
 #include <unistd.h>
 #include "TargaImage.h"
+#include "FrameReader.h"
 #include "ImageProcessor.h"
 
+//Set by signal handlers and acted on in the watch loop
+volatile sig_atomic_t reportRequested = 0;  //SIGUSR1: write missing-block reports
+volatile sig_atomic_t stopRequested   = 0;  //SIGINT, SIGTERM: save state and exit
+
+void onSignal(int sig) {
+    if(sig == SIGUSR1) reportRequested = 1;
+    else               stopRequested   = 1;
+}
+
+bool isImage(const char *name);
+char **listImages(int *count);
+int  decodeFile(ImageProcessor *processor, TargaImage *tga, char *name);
+void disposeFile(const char *name, bool remove, const char *archive);
+
 int main(int argc, char *argv[]){
 
     //Validate inputs.
-    if(argc != 2) {
-        printf("Usage: %s <path to input directory>\n",argv[0]);
+    MetricsExporter *exporter = NULL;
+    bool watch = false, remove = false;
+    char *archive = NULL;
+    PacketJournal *journal = NULL;
+    const char *journalName = NULL;
+    unsigned int source = 0;
+    Trace *trace = NULL;
+    char *bases[maxBases];
+    int nbases = 0;
+    int opt;
+    while((opt = getopt(argc, argv, "a:b:DJ:M:S:T:w")) != -1) {
+        switch(opt) {
+            case 'T': trace = new Trace("pxit-decoder", optarg); break;
+            case 'b':
+                if(nbases == maxBases) {
+                    printf("Too many previous versions, at most %d\n", maxBases);
+                    return 0;
+                }
+                bases[nbases++] = optarg;
+                break;
+            case 'a': 
+                //Keep the full path, we're about to change directory
+                archive = realpath(optarg, NULL);
+                if(!archive) {
+                    perror(optarg);
+                    return 0;
+                }
+                break;
+            case 'D': remove = true; break;
+            case 'J': journalName = optarg; break;
+            case 'S': source = strtoul(optarg, NULL, 0); break;
+            case 'M': exporter = new MetricsExporter(optarg); break;
+            case 'w': watch = true; break;
+            default:  argc = 0;             //force usage message
+        }
+    }
+
+    if(argc == 0 || optind != argc - 1 || (remove && archive)) {
+        printf("Usage: %s [-w] [-D | -a <archive directory>] [-M <metrics file>] [-J <journal> [-S <source id>]] [-b <previous version>]... [-T <trace file>] <path to input directory>\n",argv[0]);
+        printf("  -w  keep watching the directory for new images\n");
+        printf("  -D  delete images once they have been decoded\n");
+        printf("  -a  move images to another directory once they have been decoded\n");
+        printf("  -M  write decoder metrics to a file in Prometheus text format\n");
+        printf("  -J  append verified packets to a journal for pxit-merge\n");
+        printf("  -S  source id recorded in the journal (0)\n");
+        printf("  -b  a previous version of a file that deltas apply to\n");
+        printf("  -T  trace the stages of each frame as Chrome trace events\n");
         return 0;
     }
+    char *input = argv[optind];
+
+    //The journal is named relative to where we started
+    if(journalName && !(journal = PacketJournal::open(journalName, source))) return 0;
+    
+    //Previous versions are found relative to where we started too
+    ImageProcessor *processor = new ImageProcessor();
+    for(int i=0; i<nbases; i++)
+        if(!processor->addBase(bases[i])) return 0;
     
     //Validate input. Can we access the directory?
     DIR *dir;
-    if ((dir = opendir (argv[1])) == NULL) {
-        printf("Unable to open directory %s\n",argv[1]);
+    if ((dir = opendir (input)) == NULL) {
+        printf("Unable to open directory %s\n",input);
         return 0;
     }
     
@@ -59,34 +158,182 @@ int main(int argc, char *argv[]){
     printf("\t**********Welcome to pxit-decoder**********\n\n");  
     
     //Change working directory to the input directory.
-    chdir(argv[1]);
+    chdir(input);
     
-    //Create object that converts images into a file
-    ImageProcessor *processor = new ImageProcessor();
+    Metrics *metrics = processor->getMetrics();
+    processor->setJournal(journal);
+    processor->setTrace(trace);
 
-    //process all files with .tga extension
-    struct dirent *entry;
-    char buf[100];
-
-    while ((entry = readdir (dir)) != NULL) {
-        strcpy(buf,entry->d_name);
-        char *ptr = buf + strlen(buf)-4;
-
-        //if the file extension is .tga
-        if(!strcmp(ptr, ".tga")) {
-            
-            //Open the image file and get a pointer to the bitmap
-            TargaImage *tga = new TargaImage(buf,width,height);
-            int *frame = (int *)tga->getFrame();    //the bitmap
-            
-            /* ******************************************** */
-            processor->processImage(frame);
-            /* ******************************************** */
-            
-            delete(tga);
+    //In watch mode, start watching before reading the directory so that no
+    //image can slip in between.  An image that shows up in both is simply
+    //decoded twice.
+    int ifd = -1;
+    if(watch) {
+        ifd = inotify_init1(IN_CLOEXEC);
+        if(ifd < 0 || inotify_add_watch(ifd, ".", IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+            perror("inotify");
+            return 0;
         }
+
+        //Messages should show up as they happen, even in a log file
+        setvbuf(stdout, NULL, _IOLBF, 0);
+
+        //No SA_RESTART, so a signal interrupts the wait for the next image
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = onSignal;
+        sigaction(SIGUSR1, &action, NULL);
+        sigaction(SIGINT,  &action, NULL);
+        sigaction(SIGTERM, &action, NULL);
     }
+
     closedir (dir);
+
+    //process all files with .tga extension
+    int nnames;
+    char **names = listImages(&nnames);
+
+    //Images are read ahead into a pool of buffers while earlier ones decode,
+    //so time spent here is time the decoder waited for the disk
+    FrameReader *reader = new FrameReader(names, nnames);
+    const char *name;
+    bool whole;
+    while(!stopRequested) {
+        long long t0 = Metrics::now();
+        int *frame = reader->next(&name, &whole);
+        long long t1 = Metrics::now();
+        metrics->timeStage(stageInput, t1 - t0);
+        if(!frame) break;
+        if(trace) {
+            trace->nextFrame();
+            trace->span("input", t0, t1);
+        }
+
+        processor->processImage(frame);
+        if(trace) trace->span("frame", t0, Metrics::now());
+        if(whole || !watch) disposeFile(name, remove, archive);
+
+        if(exporter && exporter->due())
+            exporter->write(*metrics, processor->blocksRemaining(), processor->sessionsActive());
+    }
+    delete reader;
+    for(int i=0; i<nnames; i++) free(names[i]);
+    free(names);
+
+    //Then decode images as they arrive, one at a time into the same buffer
+    if(watch) printf("Watching %s for new images\n", input);
+    TargaImage *tga = new TargaImage(width, height);
+    char events[16*(sizeof(struct inotify_event) + NAME_MAX + 1)]
+        __attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+    while(watch && !stopRequested) {
+        if(reportRequested) {
+            reportRequested = 0;
+            processor->reportMissing();
+            if(trace) trace->write();
+        }
+
+        //Wake up now and then to export metrics even when nothing arrives
+        struct pollfd pfd = {ifd, POLLIN, 0};
+        int n = poll(&pfd, 1, 1000);
+        if(n < 0 && errno != EINTR) {
+            perror("poll");
+            break;
+        }
+
+        if(n > 0) {
+            int len = read(ifd, events, sizeof(events));
+            for(int i=0; i<len; ) {
+                struct inotify_event *event = (struct inotify_event *)(events + i);
+                i += sizeof(struct inotify_event) + event->len;
+
+                //Events were lost, so look at everything that's there.  As at
+                //the start, images that end early may be unfinished.
+                if(event->mask & IN_Q_OVERFLOW) {
+                    printf("Too many images at once, scanning %s again\n", input);
+                    names = listImages(&nnames);
+                    for(int j=0; j<nnames; j++) {
+                        if(!stopRequested) {
+                            if(trace) trace->nextFrame();
+                            decodeFile(processor, tga, names[j]);
+                            if(tga->isValid() && tga->isComplete())
+                                disposeFile(names[j], remove, archive);
+                        }
+                        free(names[j]);
+                    }
+                    free(names);
+                    continue;
+                }
+
+                //An image already handled by the directory scan may be gone
+                if(event->len == 0 || !isImage(event->name)) continue;
+                if((remove || archive) && access(event->name, F_OK) != 0) continue;
+
+                if(trace) trace->nextFrame();
+                decodeFile(processor, tga, event->name);
+                disposeFile(event->name, remove, archive);
+            }
+        }
+
+        if(exporter && exporter->due())
+            exporter->write(*metrics, processor->blocksRemaining(), processor->sessionsActive());
+    }
+
+    if(exporter)
+        exporter->write(*metrics, processor->blocksRemaining(), processor->sessionsActive());
+
+    //If the file is unfinished, say which blocks are still needed and save
+    //what we have so a later run can carry on
+    processor->reportMissing();
+    processor->checkpoint();
+    if(trace) trace->write();
     return 0;
 }
- 
\ No newline at end of file
+
+bool isImage(const char *name) {
+    int len = strlen(name);
+    return len > 4 && !strcmp(name + len - 4, ".tga");
+}
+
+//listImages() returns the names of the images in the current directory
+char **listImages(int *count) {
+    int nnames = 0, maxnames = 256;
+    char **names = (char **)malloc(maxnames * sizeof(char *));
+
+    DIR *dir = opendir(".");
+    struct dirent *entry;
+    while (dir && (entry = readdir (dir)) != NULL) {
+        if(!isImage(entry->d_name)) continue;
+        if(nnames == maxnames) {
+            maxnames *= 2;
+            names = (char **)realloc(names, maxnames * sizeof(char *));
+        }
+        names[nnames++] = strdup(entry->d_name);
+    }
+    if(dir) closedir (dir);
+    *count = nnames;
+    return names;
+}
+
+int decodeFile(ImageProcessor *processor, TargaImage *tga, char *name) {
+    Metrics *metrics = processor->getMetrics();
+
+    //Read the image file into the bitmap
+    long long t0 = Metrics::now();
+    bool ok = tga->read(name);
+    metrics->timeStage(stageInput, Metrics::now() - t0);
+    
+    /* ******************************************** */
+    if(!ok) return 0;                       //skip unreadable files
+    return processor->processImage(tga->getFrame());
+    /* ******************************************** */
+}
+
+void disposeFile(const char *name, bool remove, const char *archive) {
+    if(remove && unlink(name) < 0) perror(name);
+    if(archive) {
+        char path[PATH_MAX + NAME_MAX + 2];
+        sprintf(path, "%s/%s", archive, name);
+        if(rename(name, path) < 0) perror(name);
+    }
+}
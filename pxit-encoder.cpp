@@ -36,12 +36,65 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.*/
  *  there are 1350 color cells each representing two bits
  *  there are 1350/4 = 337 bytes per image
  * 
- * Format:
+ * Original header (-o):
  *    0 -   2 (  3 bytes): file length
  *    3 -   4 (  2 bytes): frame number
  *    5 - 332 (328 bytes): data
  *  333 - 336 (  4 bytes): checksum
  * 
+ * Extended header (the default, -x):
+ *    0 -   3 (  4 bytes): transfer id
+ *    4 -   7 (  4 bytes): file length
+ *    8 -  10 (  3 bytes): frame number
+ *   11 - 332 (322 bytes): data
+ *  333 - 336 (  4 bytes): checksum (tagged, see checksum.h)
+ *  the transfer id is a hash of the file's contents, so a receiver can
+ *  follow several interleaved files and recognize the same file when it
+ *  is sent again, so it doesn't take in a file it already has (see
+ *  pxit-received in ImageProcessor.h).  The original header names a file
+ *  only by its length and is limited to files under 16 MB.
+ * 
+ * Integrity (-C):
+ *  the extended header followed by an 8-byte hash of the whole file (see
+ *  pxit-parms.h), and a CRC32C in place of the usual checksum.  The
+ *  decoder checks the finished file against the hash.
+ * 
+ * Delta (-d):
+ *  given the previous version of the file, which the receivers already
+ *  hold, only the blocks that differ from it are sent, after manifest
+ *  frames that list them (see pxit-parms.h).  Blocks are compared at the
+ *  same offsets, so this suits files that change in place (a disk image,
+ *  a database) rather than ones where data is inserted.  The decoder is
+ *  given the previous version with -b.  Implies -C.
+ * 
+ * Top-up (-m):
+ *  given the missing-block report written by the decoder for an
+ *  unfinished file, only the frames the receiver lacks are produced.
+ *  They are named <input>-resend-NN.tga.
+ * 
+ * Fiducials (-f):
+ *  a 2x2 block of cells in each corner is reserved for alignment marks
+ *  that let the decoder find the grid in shifted or rescaled captures.
+ *  The packet shrinks to 333 bytes (324 bytes of data).
+ * 
+ * Bands (-b):
+ *  each frame carries three smaller packets, one in each band of about ten
+ *  cell rows, with their own headers and checksums (see pxit-parms.h).
+ *  Damage to one part of the picture, such as a station logo or a
+ *  scratch, costs only the bands it touches.  Blocks shrink to 103 bytes
+ *  (97 with -x), so a file needs 6 to 11% more frames.
+ * 
+ * Luma palette (-l):
+ *  colors that differ in brightness rather than hue (see pxit-parms.h),
+ *  for broadcast chains that subsample chroma.  The decoder recognizes
+ *  either palette.
+ * 
+ * Video (-y):
+ *  instead of TARGA images, all frames go to one YUV4MPEG2 stream,
+ *  <input>.y4m (or <input>-resend.y4m), in the 4:2:0 format broadcast
+ *  chains carry.  It is drawn directly in YCbCr, so no color conversion
+ *  is needed before encoding it, e.g. ffmpeg -i <input>.y4m ...
+ * 
  * I/O:
  *  path to input file supplied on command line
  *  images are created in the same directory as the input file.
@@ -57,35 +110,88 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.*/
 #include <string.h>
 #include <unistd.h>
 #include <libgen.h>
-#include "checksum.h"
+#include "Encoder.h"
 #include "TargaImage.h"
 #include "pxit-parms.h"
 
 
 
-int *frame; //holds a bitmap
-void drawCell(int row_, int col_, int color);
+bool readMissing(FILE *report, long filesize, int blkSize, long long id,
+                 bool *resend, int nblocks);
+int  changedBlocks(FILE *fp, FILE *prev, int blkSize, bool *changed, int nblocks);
+bool saveFrame(TargaImage *tga, FILE *y4m, const unsigned char *yuv, const char *base,
+               bool resend, int frameNumber);
 
 int main(int argc, char *argv[]){
 
-    //Validate inputs.  Expect only a path to the input file.
-    if(argc != 2) {
-        printf("\tUsage: %s <path to input file>\n",argv[0]);
+    //Validate inputs.  Expect options and a path to the input file.
+    bool fiducials = false;
+    bool extended = true;
+    bool video = false;
+    bool integrity = false;
+    bool banded = false;
+    int palette = paletteStandard;
+    FILE *report = NULL;
+    FILE *prev = NULL;
+    int opt;
+    while((opt = getopt(argc, argv, "bCd:flm:oxy")) != -1) {
+        switch(opt) {
+            case 'b': banded = true; break;
+            case 'C': integrity = extended = true; break;
+            case 'd':
+                prev = fopen(optarg, "r");
+                if(!prev) {
+                    perror(optarg);
+                    return 0;
+                }
+                integrity = extended = true;
+                break;
+            case 'f': fiducials = true; break;
+            case 'l': palette = paletteLuma; break;
+            case 'o': extended = false; break;
+            case 'x': extended = true; break;
+            case 'y': video = true; break;
+            case 'm': 
+                report = fopen(optarg, "r");
+                if(!report) {
+                    perror(optarg);
+                    return 0;
+                }
+                break;
+            default:  argc = 0;             //force usage message
+        }
+    }
+    if(integrity) extended = true;     //the integrity header extends it
+
+    if(argc == 0 || optind != argc - 1) {
+        printf("\tUsage: %s [-f] [-l] [-b] [-o | -x] [-C] [-y] [-d <previous version>] [-m <missing-block report>] <path to input file>\n",argv[0]);
+        printf("\t  -f  reserve corner cells for alignment fiducials\n");
+        printf("\t  -l  use the luma palette, for 4:2:0 broadcast chains\n");
+        printf("\t  -b  divide each frame into bands with a packet in each\n");
+        printf("\t  -y  write a YUV 4:2:0 video stream (.y4m) instead of images\n");
+        printf("\t  -o  use the original header (no transfer id, files under 16 MB)\n");
+        printf("\t  -x  use the extended header (the default)\n");
+        printf("\t  -C  send a hash of the file and check frames with CRC32C\n");
+        printf("\t  -d  only send the blocks that differ from the previous version\n");
+        printf("\t  -m  only produce the frames listed in a decoder's report\n");
         return 0;
     }
+    char *input = argv[optind];
 
     printf("\t**********Welcome to pxit-encoder**********\n\n");  
-    printf("\tConverting %s into image files\n\n",argv[1]);
+    printf("\tConverting %s into image files\n\n",input);
     
     //Validate input. Can we access the file?
-    char dir[200], base[200];
-    strcpy(dir,dirname(argv[1]));          //returns string up to (but not including) final /
-    strcpy(base,argv[1]+(strlen(dir)+1));  //base filename starts after the final /
+    char dir[200], base[200], tmp[200];
+    strcpy(tmp,input);
+    strcpy(dir,dirname(tmp));              //returns string up to (but not including) final /
+    strcpy(tmp,input);
+    strcpy(base,basename(tmp));            //base filename starts after the final /
     chdir(dir);
   
 
     FILE *fp=fopen(base,"r");
-    int filesize;
+    long filesize;
     
     if(fp == NULL) {
         perror("fd");
@@ -98,154 +204,211 @@ int main(int argc, char *argv[]){
     
     //Create a Targa object and get a pointer to its bitmap
 	TargaImage *tga = new TargaImage(width, height);
-    frame = (int *)tga->getFrame();
-    
-    //create an object that can compute error-correcting codes
-	CheckSum *checksum = new CheckSum(packetSize);
-    
-    //convert filesize to three bytes
-	unsigned char hi =  (unsigned char)(filesize >> 16);
-	unsigned char med = (unsigned char)(filesize >> 8);
-	unsigned char lo =  (unsigned char) filesize;
+    int *frame = (int *)tga->getFrame();
     
+    //The original header has room for a 3-byte length
+    if(filesize >= (1L << 24) && !extended) {
+        printf("\tFiles over 16 MB need the extended header, not -o\n");
+        return 0;
+    }
+    if(filesize >= (1L << 32)) {
+        printf("\tFile is too large\n");
+        return 0;
+    }
 
-	//Compute the number of images as needed to encode the selected input file
-	int framesNeeded = filesize / blockSize; 
-	if (blockSize * framesNeeded < filesize) 
-        framesNeeded++;  //The last frame will be partially filled
-
- 	int frameNumber = 0;
-	int blockSequence = 0;
-
-    unsigned char packet[packetSize];  //buffer to hold packet we're building
-    char pixelstream[packetSize * 4];  //holds color cell representation of packet
-    
-  	while(frameNumber < framesNeeded) {
-		memset(packet, 0, packetSize);
-
-		//write the file length Big Endian
-		packet[0] = hi;
-		packet[1] = med;
-		packet[2] = lo;
-
-		//now convert frameNumber into a two-byte offset.
-		int indhi = (blockSequence >> 8) & 0xFF;
-		int indlo = blockSequence & 0xFF;
-		packet[3] = indhi;
-		packet[4] = indlo;
-        
-		blockSequence++;  //prepare for next block
-
-        //Read a data block from file and copy it to packet
-        //following the header (5 bytes)
-        int bytesRead = fread(packet+5,1,blockSize,fp);
-  
-        if(bytesRead < blockSize) { //We didn't get a full block
-            if(feof(fp)) {
-                //We got the last packet.  Pad it with zeros
-                int firstzero = bytesRead + 5;  //header is 5 bytes long.
-                for(int i=firstzero; i<packetSize; i++) packet[i] = 0;
-            } else{
-                printf("packet read error\n");
-                return 0;
-            }
-        }
-        
-        //Compute checksum
-        checksum->compute(packet, packetSize);
-       
-       
-       /* At this point we have a complete date packet.  We now have to 
-        * "paint a picture".  The packet is a sequence of bytes.  Each byte
-        * is a sequence of four two-bit symbols.  The symbols are one digit
-        * numbers in the Base 4 system: 00, 01, 10, 11.  The numerals we
-        * use are actually colors: red, white, blue, and green, respectively.
-        * We call this stream of colors a 'pixelstream'.
-        */
-
-		int cell = 0;
-		for (int i = 0; i < packetSize; i++) {
-            
-            const int b1 = 4;		//  4s place
-            const int b2 = b1 * 4;	// 16s place
-            const int b3 = b2 * 4;	// 64s place
-			int base4digit[4];
+    //The transfer id identifies the file's contents
+    unsigned int id = 0;
+    if(extended) id = Encoder::hashFile(fp);
 
-            //start with a byte
-			int byte = packet[i];
+    //A delta names the version it applies to by its transfer id
+    long long baseId = prev ? (long long)Encoder::hashFile(prev) : -1;
 
-			//convert the byte into four base 4 base4digita
-			base4digit[0] = byte / b3;
-			byte -= b3*base4digit[0];
+    //The encoder builds packets and paints frames
+    Encoder *encoder = new Encoder(filesize, fiducials, extended, id, palette, integrity, baseId,
+                                   banded);
+    int blkSize = encoder->getBlockSize();
+    if(integrity) encoder->setFileHash(Encoder::hashBlocks(fp, blkSize));
+	int framesNeeded = encoder->getFramesNeeded();
 
-			base4digit[1] = byte / b2;
-			byte -= b2*base4digit[1];
+    //The original header numbers blocks with two bytes
+    if(framesNeeded > 0xFFFF && !extended) {
+        printf("\tFiles of more than 65535 blocks need the extended header, not -o\n");
+        return 0;
+    }
 
-			base4digit[2] = byte / b1;
-			byte -= b1*base4digit[2];
+    //For a delta, find the blocks that changed.  The manifest frames that
+    //list them go first.
+    bool *changed = NULL;
+    int manifestFrames = 0;
+    if(prev) {
+        changed = new bool[framesNeeded];
+        int n = changedBlocks(fp, prev, blkSize, changed, framesNeeded);
+        fclose(prev);
+        encoder->setChanged(changed);
+        manifestFrames = encoder->getManifestFrames();
+        printf("\t%d of %d blocks changed since version %08llx\n\n", n, framesNeeded, baseId);
+    }
 
-			base4digit[3] = byte;
+    //For a top-up, find out which blocks the receiver is missing
+    bool *resend = NULL;
+    if(report) {
+        resend = new bool[framesNeeded];
+        if(!readMissing(report, filesize, blkSize, extended ? (long long)id : -1,
+                        resend, framesNeeded)) return 0;
+        fclose(report);
+    }
 
-			pixelstream[cell]	  = (unsigned char)base4digit[0];
-			pixelstream[cell + 1] = (unsigned char)base4digit[1];
-			pixelstream[cell + 2] = (unsigned char)base4digit[2];
-			pixelstream[cell + 3] = (unsigned char)base4digit[3];
+    //A video stream holds every frame, drawn straight in YCbCr 4:2:0
+    FILE *y4m = NULL;
+    unsigned char *yuv = NULL;
+    if(video) {
+        char tmp[256];
+        sprintf(tmp, resend ? "%s-resend.y4m" : "%s.y4m", base);
+        y4m = fopen(tmp, "wb");
+        if(!y4m) {
+            perror(tmp);
+            return 0;
+        }
+        fprintf(y4m, "YUV4MPEG2 W%d H%d F30000:1001 Ip A10:11 C420mpeg2\n", width, height);
+        yuv = new unsigned char[width*height*3/2];
+    }
 
-			cell += 4;
-		}
-        
-        /* Now create the image by assigning colors to the squares based on the array 
-         * pixelstream.  The image will display a 45x30 array of color cells.
-         */
-
-		cell = 0;
-		
-        for (int cy = 0; cy <= 29; cy++) {              //for every row
-            for (int cx = 0; cx <= 44; cx++) {          //for every colums
-                drawCell(cy, cx, pixelstream[cell]);    //draw a solid square
-                cell++;
+ 	int frameNumber = 0;
+	int lastSequence = 0, lastRead = 0;   //the block rendered last
+    int band = 0, bands = encoder->getBandsPerFrame();
+    unsigned char block[packetSize];   //data read from the file
+    
+  	for(int i = -manifestFrames; i < framesNeeded; i++) {
+        int blockSequence, bytesRead;
+        if(i < 0) {
+            //A manifest frame, sent with every delta and top-up
+            blockSequence = manifestBase + i + manifestFrames;
+            bytesRead = encoder->manifest(i + manifestFrames, block);
+        } else {
+            blockSequence = i;
+
+            //In a top-up, skip the blocks the receiver already has, in a
+            //delta the ones it can take from the previous version
+            if(resend ? !resend[i] : changed && !changed[i]) continue;
+
+            //Read a data block from file.  Only the last one can be short.
+            fseek(fp, (long)blockSequence*blkSize, SEEK_SET);
+            bytesRead = fread(block,1,blkSize,fp);
+            if(bytesRead < blkSize && !feof(fp)) {
+                printf("packet read error\n");
+                return 0;
             }
         }
-		
-        //form a filename using frame number and save the image.
-        char tmp[256];
-        sprintf(tmp,"%s-%02d.tga",base,frameNumber);
-        tga->writeFile(tmp);
-
+        
+        if(video) encoder->renderYUV(blockSequence, block, bytesRead, yuv, band);
+        else      encoder->render(blockSequence, block, bytesRead, frame, band);
+        lastSequence = blockSequence;
+        lastRead     = bytesRead;
+
+        //A banded frame is saved once every band holds a block
+        if(++band < bands) continue;
+        band = 0;
+        if(!saveFrame(tga, y4m, yuv, base, resend != NULL, frameNumber)) return 0;
         frameNumber++;  //prepare for nexe frame.
             
-    }//end while
+    }//end for
+
+    //Bands left over in the last frame repeat its last block, which is
+    //still in the buffer: skipped blocks aren't read
+    if(band > 0) {
+        for(; band < bands; band++) {
+            if(video) encoder->renderYUV(lastSequence, block, lastRead, yuv, band);
+            else      encoder->render(lastSequence, block, lastRead, frame, band);
+        }
+        if(!saveFrame(tga, y4m, yuv, base, resend != NULL, frameNumber)) return 0;
+        frameNumber++;
+    }
     
-    printf("\t%d images produced. File conversion complete.\n\n",frameNumber);
+    if(y4m && fclose(y4m) != 0) {
+        perror("fclose");
+        return 0;
+    }
+    printf("\t%d %s produced. File conversion complete.\n\n",frameNumber,
+           video ? "video frames" : "images");
     return 0;
 }
 
-void drawCell(int row_, int col_, int value) {
+bool saveFrame(TargaImage *tga, FILE *y4m, const unsigned char *yuv, const char *base,
+               bool resend, int frameNumber) {
 
-	//Note: (row_, col_) refer to rows and columns in the rectangular array of cells.
-	//      (row , col ) refer to pixel coordinates within an image.
+    //The video stream gets every frame
+    if(y4m) {
+        fprintf(y4m, "FRAME\n");
+        if(fwrite(yuv, 1, width*height*3/2, y4m) != (size_t)width*height*3/2) {
+            perror("fwrite");
+            return false;
+        }
+        return true;
+    }
 
-    //convert cell array coordinates to image pixel coordinates
-	int row = row_*cellsize;
-	int col = col_*cellsize;
+    //form a filename using frame number and save the image.
+    char tmp[256];
+    if(resend) sprintf(tmp,"%s-resend-%02d.tga",base,frameNumber);
+    else       sprintf(tmp,"%s-%02d.tga",base,frameNumber);
+    return tga->writeFile(tmp);
+}
 
-    int pxvalue;  //pixel color expressed as an integer between 0 and 3.
-    
-	switch (value) {  //2-bit value that the cell should represent
-        case 0: pxvalue = 0xFFFF0000; break; //red
-        case 1: pxvalue = 0xFFFFFFFF; break; //white
-        case 2: pxvalue = 0xFF0000FF; break; //blue
-        case 3: pxvalue = 0xFF00FF00; break; //green
-        default:
-                //This should never happen.
-                pxvalue = 0xFF000000;        //black
-	}
-
-    //Color in the cell
-	for (int r = row; r<row + cellsize; r++) {
-		for (int c = col; c<col + cellsize; c++) {
-			*(frame + r*width + c) = pxvalue;
-		}
-	}
+int changedBlocks(FILE *fp, FILE *prev, int blkSize, bool *changed, int nblocks) {
+
+    //Compare each block with the one at the same offset in the previous
+    //version.  Blocks past its end are new.
+    unsigned char buf[packetSize], old[packetSize];
+    int n = 0;
+    for(int seq=0; seq<nblocks; seq++) {
+        int len    = fread(buf, 1, blkSize, fp);
+        int oldLen = fread(old, 1, blkSize, prev);
+        changed[seq] = len != oldLen || memcmp(buf, old, len) != 0;
+        if(changed[seq]) n++;
+    }
+    rewind(fp);
+    return n;
 }
 
+bool readMissing(FILE *report, long filesize, int blkSize, long long id,
+                 bool *resend, int nblocks) {
+
+    //The report names the file by its length, the block size the receiver
+    //was using and the transfer id if there was one.  They all have to
+    //agree with what we're about to send.
+    long long length;
+    int size;
+    if(fscanf(report, "pxit-missing length %lld blocksize %d", &length, &size) != 2) {
+        printf("\tMissing-block report is not readable\n");
+        return false;
+    }
+    unsigned int reportId;
+    bool hasId = fscanf(report, " id %x", &reportId) == 1;
+    if(hasId != (id >= 0)) {
+        printf("\tReport is for a transfer %s the extended header. Check the -o option\n",
+               hasId ? "with" : "without");
+        return false;
+    }
+    if(hasId && reportId != id) {
+        printf("\tReport is for transfer %08x, not this file\n", reportId);
+        return false;
+    }
+    if(length != filesize) {
+        printf("\tReport is for a %lld-byte file, not this one\n", length);
+        return false;
+    }
+    if(size != blkSize) {
+        printf("\tReport uses %d-byte blocks. Check the -f option\n", size);
+        return false;
+    }
+
+    //Then come the missing blocks, one number or range per line
+    for(int i=0;i<nblocks;i++) resend[i] = false;
+    int first, last;
+    while(fscanf(report, "%d", &first) == 1) {
+        last = first;
+        if(fscanf(report, "-%d", &last) != 1) last = first;
+        for(int i=first; i<=last && i<nblocks; i++)
+            if(i >= 0) resend[i] = true;
+    }
+    return true;
+}
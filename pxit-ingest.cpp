@@ -0,0 +1,197 @@
+//pxit-ingest - decodes frames handed over through shared memory.
+
+/*Copyright (c) 2020, Frank J. LoPinto
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.*/
+
+/* pxit-ingest is a decoding service for frames that come from other
+ * programs on the same machine, such as frame grabbers.  It creates a ring
+ * of frame buffers in shared memory (see FrameRing.h) and decodes frames
+ * as producers put them there, writing received files to the output
+ * directory just as pxit-decoder does.  Producers link libpxit and use
+ * FrameRing::open(), acquire() and publish(); frames are drawn straight
+ * into the ring, so nothing is copied or encoded as an image file.
+ * 
+ * With -J, packets that bring new blocks are also appended to a journal
+ * for pxit-merge.
+ * 
+ * With -T, the stages of each frame are traced (see Trace.h) and written
+ * on SIGUSR1 and at exit.
+ * 
+ * SIGINT or SIGTERM saves the state of unfinished files, removes the ring
+ * and exits; SIGUSR1 writes missing-block reports.
+ * 
+ * pxit-ingest is used for production.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include "FrameRing.h"
+#include "ImageProcessor.h"
+
+//Set by signal handlers and acted on in the main loop
+volatile sig_atomic_t reportRequested = 0;  //SIGUSR1: write missing-block reports
+volatile sig_atomic_t stopRequested   = 0;  //SIGINT, SIGTERM: save state and exit
+
+void onSignal(int sig) {
+    if(sig == SIGUSR1) reportRequested = 1;
+    else               stopRequested   = 1;
+}
+
+int main(int argc, char *argv[]){
+
+    //Validate inputs.
+    MetricsExporter *exporter = NULL;
+    const char *name = "/pxit-ingest";
+    int nslots = 16;
+    double presence = presenceFraction;
+    PacketJournal *journal = NULL;
+    const char *journalName = NULL;
+    unsigned int source = 0;
+    Trace *trace = NULL;
+    char *bases[maxBases];
+    int nbases = 0;
+    int opt;
+    while((opt = getopt(argc, argv, "b:J:M:n:p:S:s:T:")) != -1) {
+        switch(opt) {
+            case 'T': trace = new Trace("pxit-ingest", optarg); break;
+            case 'b':
+                //Keep the full path, we're about to change directory
+                if(nbases == maxBases) {
+                    printf("Too many previous versions, at most %d\n", maxBases);
+                    return 0;
+                }
+                if(!(bases[nbases++] = realpath(optarg, NULL))) {
+                    perror(optarg);
+                    return 0;
+                }
+                break;
+            case 'J': journalName = optarg; break;
+            case 'S': source = strtoul(optarg, NULL, 0); break;
+            case 'M': exporter = new MetricsExporter(optarg); break;
+            case 'n': name = optarg; break;
+            case 'p': presence = atof(optarg); break;
+            case 's': nslots = atoi(optarg); break;
+            default:  argc = 0;             //force usage message
+        }
+    }
+
+    if(argc == 0 || optind != argc - 1 || nslots < 2 || name[0] != '/') {
+        printf("Usage: %s [-n </ring name>] [-s <slots>] [-p <fraction>] [-M <metrics file>] [-J <journal> [-S <source id>]] [-b <previous version>]... [-T <trace file>] <output directory>\n",argv[0]);
+        printf("  -n  name of the shared-memory ring producers open (/pxit-ingest)\n");
+        printf("  -s  number of frames the ring holds (16)\n");
+        printf("  -p  fraction of sample cells that must show palette colors before\n");
+        printf("      a frame is decoded (%.1f); 0 decodes all\n", presenceFraction);
+        printf("  -M  write decoder metrics to a file in Prometheus text format\n");
+        printf("  -J  append verified packets to a journal for pxit-merge\n");
+        printf("  -S  source id recorded in the journal (0)\n");
+        printf("  -b  a previous version of a file that deltas apply to\n");
+        printf("  -T  trace the stages of each frame; written as Chrome trace events\n");
+        printf("      on SIGUSR1 and at exit\n");
+        return 0;
+    }
+    char *output = argv[optind];
+    if(journalName && !(journal = PacketJournal::open(journalName, source))) return 0;
+    if(chdir(output) == -1) {
+        perror(output);
+        return 0;
+    }
+
+    FrameRing *ring = FrameRing::create(name, nslots);
+    if(!ring) return 0;
+
+    printf("\t**********Welcome to pxit-ingest**********\n\n");  
+    printf("Decoding frames from shared memory %s (%d slots) into %s\n", name, nslots, output);
+
+    //Messages should show up as they happen, even in a log file
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    //No SA_RESTART, so a signal interrupts the wait for the next frame
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = onSignal;
+    sigaction(SIGUSR1, &action, NULL);
+    sigaction(SIGINT,  &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    ImageProcessor *processor = new ImageProcessor();
+    Metrics *metrics = processor->getMetrics();
+    processor->setPresence(presence);
+    processor->setJournal(journal);
+    processor->setTrace(trace);
+    for(int i=0; i<nbases; i++)
+        if(!processor->addBase(bases[i])) return 0;
+
+    //Producers drop frames rather than wait when the ring is full.  Say so
+    //now and then.
+    uint64_t dropped = 0;
+    time_t lastNote = 0;
+    while(!stopRequested) {
+        if(reportRequested) {
+            reportRequested = 0;
+            processor->reportMissing();
+            if(trace) trace->write();
+        }
+
+        //Wake up now and then to export metrics even when nothing arrives
+        long long t0 = Metrics::now();
+        const int *frame = ring->next(1000);
+        if(frame) {
+            long long t1 = Metrics::now();
+            if(trace) {
+                trace->nextFrame();
+                trace->span("dequeue", t0, t1);
+            }
+            processor->processImage(frame);
+            long long t2 = Metrics::now();
+            ring->release();
+            if(trace) {
+                long long t3 = Metrics::now();
+                trace->span("requeue", t2, t3);
+                trace->span("frame", t1, t3);
+            }
+        }
+
+        if(ring->getDropped() != dropped && time(NULL) - lastNote >= 10) {
+            dropped = ring->getDropped();
+            lastNote = time(NULL);
+            printf("Ring full: %llu frames dropped so far\n", (unsigned long long)dropped);
+        }
+
+        if(exporter && exporter->due())
+            exporter->write(*metrics, processor->blocksRemaining(), processor->sessionsActive());
+    }
+
+    ring->remove();
+    if(exporter)
+        exporter->write(*metrics, processor->blocksRemaining(), processor->sessionsActive());
+
+    //If a file is unfinished, say which blocks are still needed and save
+    //what we have so a later run can carry on
+    processor->reportMissing();
+    processor->checkpoint();
+    if(trace) trace->write();
+    return 0;
+}
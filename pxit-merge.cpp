@@ -0,0 +1,124 @@
+//pxit-merge - combines packet journals into the files they were receiving.
+
+/*Copyright (c) 2020, Frank J. LoPinto
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.*/
+
+/* pxit-merge combines packet journals (see PacketJournal.h) written by
+ * decoders run with -J, on different nights or at different receivers,
+ * into the files they were receiving.  Every packet is checked again and
+ * stored exactly as if it had just come off the video, so files are
+ * completed, verified and reported in the same way, and a partial result
+ * is saved as state that a later merge or decoding run carries on from.
+ * 
+ * Files are written to the current directory, or to -o <directory>.
+ * Journals of deltas need the previous versions they apply to (-b).
+ * 
+ * pxit-merge is used for production.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "ImageProcessor.h"
+#include "PacketJournal.h"
+
+int main(int argc, char *argv[]){
+
+    //Validate inputs.
+    const char *output = NULL;
+    char *bases[maxBases];
+    int nbases = 0;
+    int opt;
+    while((opt = getopt(argc, argv, "b:o:")) != -1) {
+        switch(opt) {
+            case 'o': output = optarg; break;
+            case 'b':
+                //Keep the full path, we're about to change directory
+                if(nbases == maxBases) {
+                    printf("Too many previous versions, at most %d\n", maxBases);
+                    return 0;
+                }
+                if(!(bases[nbases++] = realpath(optarg, NULL))) {
+                    perror(optarg);
+                    return 0;
+                }
+                break;
+            default:  argc = 0;             //force usage message
+        }
+    }
+
+    if(argc == 0 || optind >= argc) {
+        printf("Usage: %s [-o <output directory>] [-b <previous version>]... <journal> ...\n",argv[0]);
+        return 0;
+    }
+
+    //Open the journals before changing directory, so relative paths work
+    int njournals = argc - optind;
+    JournalReader *readers = new JournalReader[njournals];
+    for(int i=0; i<njournals; i++)
+        if(!readers[i].open(argv[optind + i])) return 0;
+
+    if(output && chdir(output) == -1) {
+        perror(output);
+        return 0;
+    }
+
+    printf("\t**********Welcome to pxit-merge**********\n\n");  
+
+    ImageProcessor *processor = new ImageProcessor();
+    Metrics *metrics = processor->getMetrics();
+    for(int i=0; i<nbases; i++)
+        if(!processor->addBase(bases[i])) return 0;
+
+    JournalRecord record;
+    unsigned char packet[packetSize];
+    for(int i=0; i<njournals; i++) {
+        long records = 0;
+        unsigned long newBefore  = metrics->counters[blocksNew];
+        unsigned long failBefore = metrics->counters[checksumFail];
+        uint32_t firstSource = 0;
+        bool oneSource = true;
+
+        while(readers[i].next(&record, packet)) {
+            if(records == 0) firstSource = record.source;
+            else if(record.source != firstSource) oneSource = false;
+            records++;
+            processor->processPacket(packet, record.length);
+        }
+
+        printf("%s: %ld packets", argv[optind + i], records);
+        if(records && oneSource) printf(" from source %u", firstSource);
+        else if(records)         printf(" from several sources");
+        printf(", %lu new blocks", metrics->counters[blocksNew] - newBefore);
+        if(metrics->counters[checksumFail] != failBefore)
+            printf(", %lu damaged", metrics->counters[checksumFail] - failBefore);
+        if(readers[i].truncated()) printf(", ends in a partial record");
+        printf("\n");
+    }
+
+    //If a file is unfinished, say which blocks are still needed and save
+    //what we have so a later run can carry on
+    processor->reportMissing();
+    processor->checkpoint();
+    return 0;
+}
@@ -1,14 +1,61 @@
 /* pxit-parms.h - defines properties pxit images
- * 
+ *
  * Resolution:  720x480 pixels
  * Cell size:     16x16 pixels
- * 
+ *
  * Packet size: 337 bytes
      * header:    5 bytes
      * data:    328 bytes
      * checksum:  4 bytes
+ *
+ * Frames drawn with fiducials reserve a 2x2 block of cells in each corner
+ * of the grid (see GridAligner.h).  That leaves 1334 cells for data, so the
+ * packet shrinks to 333 bytes and the data field to 324 bytes.
+ *
+ * Extended header: 11 bytes (checksum tagged with tagExtended)
+     * transfer id: 4 bytes
+     * file length: 4 bytes
+     * sequence:    3 bytes
+ * The transfer id lets a receiver follow several files at once.  The data
+ * field shrinks by 6 bytes.
+ *
+ * Integrity header: 19 bytes (checksum is a CRC32C, see checksum.h)
+     * the extended header, followed by
+     * file hash:   8 bytes
+ * The receiver checks the finished file against the hash, so a transfer
+ * ends in a definite success or failure.  The data field shrinks by 14
+ * bytes.
+ *
+ * Delta header: 23 bytes (checksum is a CRC32C tagged with "DLTA")
+     * the integrity header, followed by
+     * base id:     4 bytes, transfer id of the previous version
+ * Only blocks that differ from the previous version are sent, plus
+ * manifest packets, numbered from manifestBase, that list them:
+     * parts:       2 bytes, number of manifest packets
+     * ranges:      2 bytes, number of ranges in this packet
+     * then for each range of changed blocks
+     * first:       3 bytes
+     * count:       3 bytes
+ * The receiver takes every other block from its copy of the previous
+ * version.
+ *
+ * Bands: a frame can instead carry three packets of 112 bytes (111 with
+ * fiducials), one in each band of about ten cell rows, each with its own
+ * header and checksum.  A scratch or an overlay in one part of the
+ * picture then costs only the packets of the bands it touches.  Each
+ * packet holds one block, so a band's data field is the band packet size
+ * less the header and checksum.
+ *
+ * Palettes: the standard colors differ mostly in chroma, which 4:2:0
+ * subsampling blurs.  The luma palette spaces its colors evenly in
+ * brightness (Y' = 41, 112, 182, 255) so they can be told apart even when
+ * their chroma has been smeared, and assigns symbols in Gray code order so
+ * that mistaking a color for its neighbor in brightness costs one bit.
+ * None of the colors is dark enough to be taken for a fiducial.
  */
- 
+#ifndef PXIT_PARMS_H
+#define PXIT_PARMS_H
+
 const int width      = 720;
 const int height     = 480;
 const int cellsize   =  16;
@@ -17,4 +64,31 @@ const int csumSize   =   4; //4-byte checksum
 const int headerSize =   5; //size of packet header
 const int blockSize = packetSize - headerSize - csumSize;
 
+const int nrows  = height/cellsize;   //30 rows of cells
+const int ncols  = width /cellsize;   //45 columns of cells
+const int ncells = nrows*ncols;       //1350 cells
+
+const int fiducialCells = 16;         //four 2x2 corner blocks
+const int fidPacketSize = (ncells - fiducialCells)/4;
+const int fidBlockSize  = fidPacketSize - headerSize - csumSize;
+
+const int nBands            = 3;
+const int bandPacketSize    = ncells/nBands/4;                   //112 bytes
+const int fidBandPacketSize = (ncells - fiducialCells)/nBands/4; //111 bytes
+
+const int extHeaderSize = 11;
+const int integHeaderSize = 19;
+const int deltaHeaderSize = 23;
+const int manifestBase    = 0xF00000;  //sequence number of the first manifest packet
+
+const int paletteStandard = 0;
+const int paletteLuma     = 1;
+const int nPalettes       = 2;
+
+//0xAARRGGBB color of each symbol
+const unsigned int symbolColor[nPalettes][4] = {
+    {0xFFFF0000, 0xFFFFFFFF, 0xFF0000FF, 0xFF00FF00},   //red, white, blue, green
+    {0xFF0014FF, 0xFFFF3E00, 0xFFFFFFFF, 0xFF64F064},   //blue, orange, white, green
+};
 
+#endif
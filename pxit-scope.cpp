@@ -32,6 +32,27 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.*/
  * The program expects to get a TARGA file as an input.  It bases the names of
  * its output files on the input filename.
  * 
+ * Batch mode (-d) examines every TARGA file in a directory, several at a
+ * time, and collects statistics for each cell instead:
+ *   margin    how far the sample is from the decision boundary between its
+ *             color and the next nearest one: 1 for a pure palette color,
+ *             0 for a sample halfway between two colors
+ *   outside   fraction of samples that are not near any of the four colors
+ *   disagree  fraction of frames in which the two fields gave different
+ *             colors
+ * The results go to pxit-scope-cells.csv and pxit-scope-heatmap.tga in the
+ * current directory.  The heatmap has one panel per statistic (low margin,
+ * outside, disagree), each scaled to its worst cell: black is good, yellow
+ * is the worst.
+ * 
+ * Ground-truth mode (-t) compares what the decoder reads from each image with
+ * what the encoder drew, given the original file and the encoder's options
+ * (-f, -l, -o).  Each image is matched to its block by the sequence number in
+ * its header or, when the header is damaged, by finding the block whose
+ * symbols are closest.  It reports symbol and bit error rates, a confusion
+ * matrix of drawn against decoded colors, and writes the position of every
+ * wrong symbol to pxit-scope-errors.csv.
+ * 
  * pxit-scope is used for debugging.
  */
  
@@ -42,24 +63,85 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.*/
 #include <string.h>
 #include <dirent.h>
 #include <unistd.h>
+#include <stdlib.h>
+#include <math.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "Encoder.h"
+#include "GridAligner.h"
+#include "ImageProcessor.h"
 #include "TargaImage.h"
+#include "pxit-parms.h"     //a 720x480 image displaying a 45x30 array of 16x16 color cells
+
+//Statistics for one cell, accumulated over a batch of frames
+struct CellStats {
+    long   samples;         //sample points examined (two per frame)
+    double margin;          //sum of classification margins
+    double minMargin;
+    long   outside;         //samples not near any of the four colors
+    long   disagree;        //frames whose two fields gave different colors
+};
 
-// Constants describe a 720x480 image displaying a 45x30 array of 16x16 color cells.
-const int cellsize = 16;
-const int width = 720;
-const int height = 480;
+//Frames are handed out to worker threads one at a time.  Each worker
+//keeps its own statistics, which are added up at the end.
+struct Batch {
+    char    **files;
+    int       nfiles;
+    int       next;         //next file to examine
+};
+
+struct Worker {
+    Batch    *batch;
+    pthread_t thread;
+    long      frames;
+    CellStats cells[ncells];
+};
 
 // Function prototypes 
 void drawCell(int row_, int col_, char value,int *frame);
 void showSamplePoints(int *frame, int *sp1, int *sp2);
+void getSamples(int *frame, int *sp1, int *sp2);
 char computeColor(int pixelcolor);
+double computeMargin(int pixelcolor);
+int  scanDirectory(const char *dirname, int nthreads);
+int  groundTruth(const char *original, bool fiducials, bool extended, int palette,
+                 const char *input);
+int  listImages(const char *dirname, char ***files);
+void *scanFrames(void *arg);
+void writeHeatmap(const CellStats *cells, long frames, const char *fname);
  
 int main(int argc, char *argv[]){
     
-    if(argc != 2) {
+    int opt, nthreads = 0;
+    char *batchDir = NULL, *original = NULL;
+    bool fiducials = false, extended = true;
+    int palette = paletteStandard;
+    while((opt = getopt(argc, argv, "d:fj:lot:x")) != -1) {
+        switch(opt) {
+            case 'd': batchDir = optarg; break;
+            case 'f': fiducials = true; break;
+            case 'j': nthreads = atoi(optarg); break;
+            case 'l': palette = paletteLuma; break;
+            case 't': original = optarg; break;
+            case 'o': extended = false; break;
+            case 'x': extended = true; break;
+            default:  argc = 0;             //force usage message
+        }
+    }
+
+    if(argc && batchDir && !original && optind == argc) 
+        return scanDirectory(batchDir, nthreads);
+
+    if(argc && original && !batchDir && optind == argc - 1)
+        return groundTruth(original, fiducials, extended, palette, argv[optind]);
+
+    if(argc == 0 || batchDir || original || optind != argc - 1) {
         printf("Usage: %s <input file>\n",argv[0]);
+        printf("       %s -d <directory> [-j <threads>]\n",argv[0]);
+        printf("       %s -t <original file> [-f] [-l] [-o] <input file or directory>\n",argv[0]);
         return 0;
     }
+    argv += optind - 1;     //the input file is argv[1] from here on
     
     char ifname[200];       //input filename 
     char ofname[200];       //output filenames based on basename
@@ -99,6 +181,7 @@ int main(int argc, char *argv[]){
     //Instantiate an object to manipulate TARGA images
     TargaImage *tga = new TargaImage(argv[1],720,480);
     int *frame = (int *)tga->getFrame();
+    if(!tga->isValid()) return -1;
     int sp1[45*30], sp2[45*30];  //RGB colors at sampling points
     strcpy(ofname,ifname);
     strcat(ofname,"-annotated.tga");
@@ -183,6 +266,21 @@ void showSamplePoints(int *frame, int *sp1, int *sp2) {
     //color cell locations
     
     //sp1 and sp2 arrays are to be filledin with 32-bit color values
+    getSamples(frame, sp1, sp2);
+
+    for (int celrow= 0; celrow <= 29; celrow++) {
+        for (int celcol = 0; celcol <= 44; celcol++) { //loop over cell numbers
+            int ix = celcol*cellsize + cellsize/2;
+            int iy = celrow*cellsize + cellsize/2;
+            *(frame + (iy+1)*width + ix) = 0xFF000000;
+            *(frame + iy*width + ix)     = 0xFFffff00;
+        }
+    }
+}
+
+void getSamples(int *frame, int *sp1, int *sp2) {
+    //Read the colors at the sample point of each cell (field 2) and on
+    //the line below (field 1)
     
     int cell=0;
 
@@ -201,13 +299,348 @@ void showSamplePoints(int *frame, int *sp1, int *sp2) {
             
             int z1 = (iy+1)*width +ix;          
             *(sp2+cell) = *(frame + z1);
-            *(frame + z1) = 0xFF000000;
     
             int z = iy * width + ix;            
             *(sp1+cell) = *(frame + z);
-            *(frame + z)  = 0xFFffff00;
             
             cell++;
         }
     }
-}
\ No newline at end of file
+}
+
+double computeMargin(int pixelcolor) {
+
+    //Distances to the nearest and next nearest of the four colors.  Any
+    //two of them are 255*sqrt(2) apart, so the margin is 1 for a pure
+    //color and 0 halfway between two.
+    static const int palette[4][3] = {{255,0,0}, {255,255,255}, {0,0,255}, {0,255,0}};
+    int red = (pixelcolor >> 16) & 0xFF;
+    int grn = (pixelcolor >>  8) & 0xFF;
+    int blu = (pixelcolor      ) & 0xFF;
+
+    double d1 = 1e9, d2 = 1e9;
+    for(int i=0;i<4;i++) {
+        double dr = red - palette[i][0], dg = grn - palette[i][1], db = blu - palette[i][2];
+        double d = sqrt(dr*dr + dg*dg + db*db);
+        if(d < d1)      {d2 = d1; d1 = d;}
+        else if(d < d2) d2 = d;
+    }
+    return (d2 - d1) / (255*sqrt(2.0));
+}
+
+int scanDirectory(const char *dirname, int nthreads) {
+
+    Batch batch;
+    batch.next = 0;
+    batch.nfiles = listImages(dirname, &batch.files);
+    if(batch.nfiles < 0) return -1;
+
+    if(nthreads <= 0) nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if(nthreads > batch.nfiles) nthreads = batch.nfiles;
+    if(nthreads < 1) {
+        printf("No .tga files in %s\n",dirname);
+        return 0;
+    }
+
+    printf("\t**********Welcome to pxit-scope**********\n\n");  
+    printf("Analyze %d images in %s with %d threads\n\n",batch.nfiles,dirname,nthreads);
+
+    Worker *workers = new Worker[nthreads];
+    for(int i=0;i<nthreads;i++) {
+        workers[i].batch = &batch;
+        pthread_create(&workers[i].thread, NULL, scanFrames, &workers[i]);
+    }
+
+    //Add up what the workers found
+    CellStats cells[ncells];
+    long frames = 0;
+    memset(cells, 0, sizeof(cells));
+    for(int z=0;z<ncells;z++) cells[z].minMargin = 1;
+
+    for(int i=0;i<nthreads;i++) {
+        pthread_join(workers[i].thread, NULL);
+        frames += workers[i].frames;
+        for(int z=0;z<ncells;z++) {
+            CellStats *w = &workers[i].cells[z];
+            cells[z].samples  += w->samples;
+            cells[z].margin   += w->margin;
+            cells[z].outside  += w->outside;
+            cells[z].disagree += w->disagree;
+            if(w->minMargin < cells[z].minMargin) cells[z].minMargin = w->minMargin;
+        }
+    }
+    delete [] workers;
+    if(frames == 0) {
+        printf("No readable images in %s\n",dirname);
+        return -1;
+    }
+
+    //One line per cell
+    const char *csvname = "pxit-scope-cells.csv";
+    FILE *csv = fopen(csvname,"w");
+    if(!csv) {
+        perror(csvname);
+        return -1;
+    }
+    fprintf(csv,"row,col,frames,margin,min_margin,outside,disagree\n");
+    int worst = 0;
+    for(int z=0;z<ncells;z++) {
+        const CellStats *c = &cells[z];
+        fprintf(csv,"%d,%d,%ld,%.4f,%.4f,%.4f,%.4f\n", z/ncols, z%ncols, frames,
+                c->margin/c->samples, c->minMargin, (double)c->outside/c->samples,
+                (double)c->disagree/frames);
+        if(c->margin < cells[worst].margin) worst = z;
+    }
+    fclose(csv);
+    printf("Created %s\n",csvname);
+
+    writeHeatmap(cells, frames, "pxit-scope-heatmap.tga");
+
+    printf("\n%ld frames. Lowest mean margin %.3f at row %d, col %d\n", frames,
+           cells[worst].margin/cells[worst].samples, worst/ncols, worst%ncols);
+    return 0;
+}
+
+int listImages(const char *dirname, char ***files) {
+
+    //List the .tga files in a directory, in name order
+    struct dirent **entries;
+    int n = scandir(dirname, &entries, NULL, alphasort);
+    if(n < 0) {
+        printf("Unable to open directory %s\n",dirname);
+        return -1;
+    }
+
+    int nfiles = 0;
+    *files = (char **)malloc((n + 1) * sizeof(char *));
+    for(int i=0;i<n;i++) {
+        char *ptr = strrchr(entries[i]->d_name, '.');
+        if(ptr && !strcmp(ptr, ".tga")) {
+            char *path = (char *)malloc(strlen(dirname) + strlen(entries[i]->d_name) + 2);
+            sprintf(path, "%s/%s", dirname, entries[i]->d_name);
+            (*files)[nfiles++] = path;
+        }
+        free(entries[i]);
+    }
+    free(entries);
+    return nfiles;
+}
+
+void *scanFrames(void *arg) {
+    Worker *w = (Worker *)arg;
+    w->frames = 0;
+    memset(w->cells, 0, sizeof(w->cells));
+    for(int z=0;z<ncells;z++) w->cells[z].minMargin = 1;
+
+    int sp1[ncells], sp2[ncells];
+    int i;
+    while((i = __sync_fetch_and_add(&w->batch->next, 1)) < w->batch->nfiles) {
+        TargaImage *tga = new TargaImage(w->batch->files[i],width,height);
+        getSamples((int *)tga->getFrame(), sp1, sp2);
+        bool valid = tga->isValid();
+        delete tga;
+        if(!valid) continue;
+
+        for(int z=0;z<ncells;z++) {
+            CellStats *c = &w->cells[z];
+            int sample[2] = {sp1[z], sp2[z]};
+            for(int k=0;k<2;k++) {
+                double m = computeMargin(sample[k]);
+                c->margin += m;
+                if(m < c->minMargin) c->minMargin = m;
+                if(computeColor(sample[k]) == 4) c->outside++;
+            }
+            c->samples += 2;
+            if(computeColor(sp1[z]) != computeColor(sp2[z])) c->disagree++;
+        }
+        w->frames++;
+    }
+    return NULL;
+}
+
+void writeHeatmap(const CellStats *cells, long frames, const char *fname) {
+
+    //Three panels of 45x30 squares side by side, one cell apart
+    const int scale = 8;
+    const int panelWidth = ncols*scale;
+    const int mapWidth = 3*panelWidth + 2*scale;
+    const int mapHeight = nrows*scale;
+
+    double value[3][ncells], worst[3] = {0, 0, 0};
+    for(int z=0;z<ncells;z++) {
+        value[0][z] = 1 - cells[z].margin/cells[z].samples;
+        value[1][z] = (double)cells[z].outside/cells[z].samples;
+        value[2][z] = (double)cells[z].disagree/frames;
+        for(int k=0;k<3;k++) if(value[k][z] > worst[k]) worst[k] = value[k][z];
+    }
+
+    TargaImage *tga = new TargaImage(mapWidth, mapHeight);
+    int *map = (int *)tga->getFrame();
+    for(int i=0;i<mapWidth*mapHeight;i++) map[i] = 0xFF000000;
+
+    for(int k=0;k<3;k++) {
+        for(int z=0;z<ncells;z++) {
+
+            //black, through red, to yellow for the worst cell
+            double v = worst[k] > 0 ? value[k][z] / worst[k] : 0;
+            int red = v < 0.5 ? (int)(510*v) : 255;
+            int grn = v < 0.5 ? 0 : (int)(510*(v - 0.5));
+            int color = 0xFF000000 | (red << 16) | (grn << 8);
+
+            int x0 = k*(panelWidth + scale) + (z%ncols)*scale;
+            int y0 = (z/ncols)*scale;
+            for(int y=y0;y<y0+scale;y++)
+                for(int x=x0;x<x0+scale;x++)
+                    map[y*mapWidth + x] = color;
+        }
+    }
+
+    tga->writeFile((char *)fname);
+    delete tga;
+    printf("Created %s (worst cells: margin %.3f, outside %.3f, disagree %.3f)\n",
+           fname, 1 - worst[0], worst[1], worst[2]);
+}
+
+int groundTruth(const char *original, bool fiducials, bool extended, int palette,
+                const char *input) {
+
+    //Read the original file
+    FILE *fp = fopen(original, "r");
+    if(!fp) {
+        perror(original);
+        return -1;
+    }
+    fseek(fp, 0L, SEEK_END);
+    long filesize = ftell(fp);
+    rewind(fp);
+    unsigned char *data = new unsigned char[filesize + 1];
+    if(fread(data, 1, filesize, fp) != (size_t)filesize) {
+        printf("%s: read error\n", original);
+        return -1;
+    }
+    fclose(fp);
+
+    Encoder *encoder = new Encoder(filesize, fiducials, extended,
+                                   extended ? Encoder::hash(data, filesize) : 0, palette);
+    ImageProcessor *processor = new ImageProcessor();
+    int blkSize = encoder->getBlockSize();
+    int nblocks = encoder->getFramesNeeded();
+    int nsymbols = fiducials ? ncells - fiducialCells : ncells;
+    if(nblocks == 0) {
+        printf("%s is empty\n", original);
+        return 0;
+    }
+
+    //Row and column of each symbol
+    int cellRow[ncells], cellCol[ncells], n = 0;
+    for(int r=0;r<nrows;r++)
+        for(int c=0;c<ncols;c++)
+            if(!fiducials || !GridAligner::isFiducialCell(r,c)) {
+                cellRow[n] = r;
+                cellCol[n++] = c;
+            }
+
+    //A single image, or every image in a directory
+    char **files;
+    int nfiles = 1;
+    struct stat st;
+    if(stat(input, &st) == 0 && S_ISDIR(st.st_mode)) nfiles = listImages(input, &files);
+    else files = (char **)&input;
+    if(nfiles <= 0) return -1;
+
+    const char *csvname = "pxit-scope-errors.csv";
+    FILE *csv = fopen(csvname,"w");
+    if(!csv) {
+        perror(csvname);
+        return -1;
+    }
+    fprintf(csv,"image,block,row,col,drawn,decoded\n");
+
+    printf("\t**********Welcome to pxit-scope**********\n\n");  
+    printf("Compare %d images with %s (%d blocks)\n\n",nfiles,original,nblocks);
+
+    static const char *colorNames[nPalettes][4] = {{"red", "white", "blue", "green"},
+                                                   {"blue", "orange", "white", "green"}};
+    const char **colorName = colorNames[palette];
+    long confusion[4][4];
+    memset(confusion, 0, sizeof(confusion));
+    long symbols = 0, symbolErrors = 0, bitErrors = 0;
+    int  matched = 0;
+
+    char decoded[ncells];
+    unsigned char packet[packetSize];
+    for(int f=0;f<nfiles;f++) {
+        TargaImage *tga = new TargaImage(files[f],width,height);
+        int got = processor->getSymbols((int *)tga->getFrame(), decoded, palette);
+        bool valid = tga->isValid();
+        delete tga;
+        if(!valid) continue;
+        if(got != nsymbols) {
+            printf("%s: %s\n", files[f], fiducials ? "fiducials not found" 
+                                                   : "has fiducials, use -f");
+            continue;
+        }
+
+        //Try the sequence number in the header first, even if the checksum
+        //failed.  If that block is far off, look for the closest one.
+        for(int i=0;i<encoder->getPacketSize();i++)
+            packet[i] = (decoded[4*i] << 6) | (decoded[4*i+1] << 4) |
+                        (decoded[4*i+2] << 2) | decoded[4*i+3];
+        int seq = extended ? (packet[8] << 16) | (packet[9] << 8) | packet[10]
+                           : (packet[3] << 8) | packet[4];
+
+        int best = -1, bestErrors = nsymbols + 1;
+        for(int pass=0; pass<2 && bestErrors > nsymbols/4; pass++) {
+            for(int b=0;b<nblocks;b++) {
+                if(pass == 0 && b != seq) continue;
+                long offset = (long)b*blkSize;
+                int len = filesize - offset < blkSize ? filesize - offset : blkSize;
+                const char *drawn = encoder->getPixelstream(b, data + offset, len);
+                int errors = 0;
+                for(int k=0;k<nsymbols && errors<bestErrors;k++)
+                    errors += drawn[k] != decoded[k];
+                if(errors < bestErrors) {
+                    best = b;
+                    bestErrors = errors;
+                }
+            }
+        }
+
+        //Count the errors against the block we settled on
+        long offset = (long)best*blkSize;
+        int len = filesize - offset < blkSize ? filesize - offset : blkSize;
+        const char *drawn = encoder->getPixelstream(best, data + offset, len);
+        int bits = 0;
+        for(int k=0;k<nsymbols;k++) {
+            confusion[(int)drawn[k]][(int)decoded[k]]++;
+            if(drawn[k] == decoded[k]) continue;
+            int x = drawn[k] ^ decoded[k];
+            bits += (x & 1) + (x >> 1);
+            fprintf(csv,"%s,%d,%d,%d,%s,%s\n", files[f], best, cellRow[k], cellCol[k],
+                    colorName[(int)drawn[k]], colorName[(int)decoded[k]]);
+        }
+        printf("%s: block %d%s, %d symbol errors, %d bit errors\n", files[f], best,
+               best == seq ? "" : " (matched)", bestErrors, bits);
+
+        symbols += nsymbols;
+        symbolErrors += bestErrors;
+        bitErrors += bits;
+        matched++;
+    }
+    fclose(csv);
+
+    if(!matched) return 0;
+    printf("\n%d images, %ld symbols\n", matched, symbols);
+    printf("Symbol error rate: %.3e (%ld)\n", (double)symbolErrors/symbols, symbolErrors);
+    printf("Bit error rate:    %.3e (%ld)\n", (double)bitErrors/(2*symbols), bitErrors);
+    printf("\nDrawn (rows) against decoded (columns):\n%8s", "");
+    for(int j=0;j<4;j++) printf("%10s", colorName[j]);
+    printf("\n");
+    for(int i=0;i<4;i++) {
+        printf("%8s", colorName[i]);
+        for(int j=0;j<4;j++) printf("%10ld", confusion[i][j]);
+        printf("\n");
+    }
+    printf("\nError positions written to %s\n", csvname);
+    return 0;
+}